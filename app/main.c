@@ -1,22 +1,121 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
+#include <ctype.h>
 #include <curl/curl.h>
 #include <curl/easy.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 
 const int32_t PEER_INFO_SIZE = 6;
+const uint32_t BLOCK_SIZE = 1 << 14;
+// bounds on the number of block requests kept outstanding per peer
+const uint32_t MIN_QUEUE_DEPTH = 2;
+const uint32_t MAX_QUEUE_DEPTH = 256;
+// how many bandwidth-delay products worth of blocks to keep in flight
+const double QUEUE_GAIN = 2.0;
+// upper bound on simultaneous peer connections during a download
+const int32_t MAX_PEERS = 256;
+// bytes of a peer's messages read at a time, at the least
+const uint32_t RECV_BUFFER = 1 << 15;
+// port we accept peers on, and bounds on what a peer may ask of us
+const uint16_t DEFAULT_PORT = 6881;
+const uint32_t MAX_UPLOAD_QUEUE = 256;
+// smaller payloads are copied even with zerocopy, pinning pages costs more
+const uint32_t ZEROCOPY_MIN = 1 << 13;
+const uint32_t MAX_REQUEST_LENGTH = 1 << 17;
+// pieces a choked peer speaking the Fast Extension may still fetch from us
+const uint32_t ALLOWED_FAST_SET = 10;
+// our id for ut_metadata messages (BEP 9), the size of a piece of the info
+// dict they carry, and the largest info dict a magnet link may bring
+const uint8_t UT_METADATA_ID = 1;
+const uint32_t METADATA_PIECE = 1 << 14;
+const int64_t MAX_METADATA = 1 << 24;
+// peers unchoked by rate, besides the optimistic one, and how often the
+// choker runs and rotates the optimistic unchoke (in rounds)
+const int32_t UNCHOKE_SLOTS = 4;
+const int64_t CHOKE_INTERVAL = 10000000;
+const uint32_t OPTIMISTIC_ROUNDS = 3;
+// a peer with requests out and no block for this long is snubbed
+const int64_t SNUB_TIMEOUT = 20000000;
+// seconds allowed for connecting and exchanging handshakes
+const int32_t CONNECT_TIMEOUT = 10;
+// seconds between announces when the tracker does not say and the least
+// we accept, and the wait after a round in which no URL of a tier
+// answered, doubled for each such round in a row
+const int64_t ANNOUNCE_INTERVAL = 1800;
+const int64_t MIN_ANNOUNCE_INTERVAL = 60;
+const int64_t ANNOUNCE_RETRY = 60;
+// UDP trackers: seconds to wait for a reply, doubled with each of the
+// retransmissions, and how long a connection ID may be used (BEP 15)
+const int64_t UDP_PROTOCOL_ID = 0x41727101980;
+const int32_t UDP_TIMEOUT = 15;
+const uint32_t UDP_RETRIES = 2;
+const int32_t UDP_CONNECTION_TTL = 60;
+// microseconds between checks on a tracker host lookup
+const int64_t LOOKUP_POLL = 20000;
+// connections being dialed at once, and how many peers we remember
+const int32_t MAX_CONNECTING = 32;
+const uint32_t MAX_CANDIDATES = 4096;
+// seconds before redialing a peer, doubled on each failure in a row, and
+// the failures after which it is given up
+const int32_t RETRY_DELAY = 4;
+const uint8_t MAX_FAILS = 3;
+// seconds a peer may stay silent before its connection is given up, past
+// the two minutes between keep-alives, and how long we may stay silent
+// before we send one
+const int32_t PEER_TIMEOUT = 150;
+const int32_t KEEPALIVE_INTERVAL = 90;
+// piece verification threads, and how many pieces may wait for them
+const int32_t MAX_HASH_THREADS = 8;
+const uint32_t HASH_QUEUE_DEPTH = 64;
+// bytes each recheck or create thread takes from the data at a time
+const uint32_t HASH_BATCH = 1 << 24;
+// create picks the smallest piece length giving at most this many pieces
+const int64_t CREATE_MAX_PIECES = 2048;
+// microseconds between two lines of the metrics export
+const int64_t METRICS_INTERVAL = 1000000;
 
 bool is_digit(char c) { return c >= '0' && c <= '9'; }
 uint32_t min(uint32_t x, uint32_t y) { return x < y ? x : y; }
 
+int64_t min64(int64_t x, int64_t y) { return x < y ? x : y; }
+uint32_t max(uint32_t x, uint32_t y) { return x > y ? x : y; }
+
+int64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 typedef struct bevalue_t bevalue_t;
 typedef struct bedictitem_t bedictitem_t;
 
@@ -51,119 +150,39 @@ struct bedictitem_t {
   bevalue_t val;
 };
 
-int32_t bevec_init(bevec_t *l, bool is_dict) {
-  bevec_t li;
-  int32_t new_cap = 4;
-  if (is_dict) {
-    bedictitem_t *data = (bedictitem_t *)malloc(new_cap * sizeof(bedictitem_t));
-    if (data == NULL) {
-      fprintf(stderr, "Failed allocate memory\n");
-      return 1;
-    }
-    li.data.dict = data;
-  } else {
-    bevalue_t *data = (bevalue_t *)malloc(new_cap * sizeof(bevalue_t));
-    if (data == NULL) {
-      fprintf(stderr, "Failed allocate memory\n");
-      return 1;
-    }
-    li.data.list = data;
-  }
-  li.cap = new_cap;
-  li.len = 0;
-  li.is_dict = is_dict;
-  *l = li;
-  return 0;
-}
-
-int32_t bevec_push(bevec_t *l, void *x) {
-  if (l->len == l->cap) {
-    int32_t new_cap = 2 * l->cap;
-    if (l->is_dict) {
-      bedictitem_t *new_data =
-          (bedictitem_t *)realloc(l->data.dict, new_cap * sizeof(bedictitem_t));
-      if (new_data == NULL) {
-        fprintf(stderr, "Failed re-allocate memory\n");
-        return 1;
-      }
-      l->data.dict = new_data;
-    } else {
-      bevalue_t *new_data =
-          (bevalue_t *)realloc(l->data.list, new_cap * sizeof(bevalue_t));
-      if (new_data == NULL) {
-        fprintf(stderr, "Failed re-allocate memory\n");
-        return 1;
-      }
-      l->data.list = new_data;
-    }
-    l->cap = new_cap;
-  }
-
-  if (l->is_dict) {
-    l->data.dict[l->len++] = *(bedictitem_t *)x;
-  } else {
-    l->data.list[l->len++] = *(bevalue_t *)x;
-  }
-
-  return 0;
-}
-
-void bevec_free(bevec_t *v);
-
-void bevalue_free(bevalue_t *v) {
-  switch (v->type) {
-  case BE_INT:
-    break;
-  case BE_STR:
-    break;
-  case BE_VEC:
-    bevec_free(&v->val.vec);
-    break;
-  }
-}
-
-void bevec_free(bevec_t *v) {
-  if (v->is_dict) {
-    for (int32_t i = 0; i < v->len; ++i) {
-      bevalue_free(&v->data.dict[i].val);
-    }
-    free(v->data.dict);
-  } else {
-    for (int32_t i = 0; i < v->len; ++i) {
-      bevalue_free(&v->data.list[i]);
-    }
-    free(v->data.list);
-  }
-}
+// Nesting limit for lists and dicts, which bounds the decoder's recursion.
+const int32_t BE_MAX_DEPTH = 256;
 
-// TODO: disambiguate error and key not found
-bevalue_t *bevec_dict_get(bevec_t *v, char *str) {
-  if (!v->is_dict) {
-    fprintf(stderr, "Not a dictionary\n");
-    return NULL;
-  }
-  bevalue_t *val = NULL;
-  for (int32_t i = 0; i < v->len; ++i) {
-    bestring_t key = v->data.dict[i].key;
-    if (strncmp(key.str, str, key.n) == 0) {
-      val = &v->data.dict[i].val;
-      break;
-    }
-  }
-  return val;
-}
+// A decoded document. Its lists and dicts share one arena, sized by a first
+// pass over the input, and its strings point into the input, which has to
+// outlive it. The whole document is released with a single free.
+typedef struct {
+  bevalue_t root;
+  void *arena;
+} bedoc_t;
 
-int32_t next_value(char **ptr, bevalue_t *beval);
+// State of the two decoding passes. The first records the element count of
+// every list and dict in input order, the second hands out arena slots.
+typedef struct {
+  uint32_t *sizes;
+  uint32_t nvecs;
+  uint32_t cap;
+  uint32_t nvalues;
+  uint32_t nitems;
+  bevalue_t *values;
+  bedictitem_t *items;
+  char *end;
+} bescan_t;
 
-int32_t next_str(char **ptr, bestring_t *bestr) {
+int32_t next_str(char **ptr, char *end, bestring_t *bestr) {
   char *begin = *ptr;
-  for (; **ptr != ':' && **ptr != '\0'; ++*ptr) {
+  for (; *ptr < end && **ptr != ':'; ++*ptr) {
     if (!is_digit(**ptr)) {
       fprintf(stderr, "Invalid string encoding\n");
       return 1;
     }
   }
-  if (**ptr != ':') {
+  if (*ptr == end) {
     fprintf(stderr, "No color seperator found\n");
     return 1;
   }
@@ -177,21 +196,21 @@ int32_t next_str(char **ptr, bestring_t *bestr) {
   return 0;
 }
 
-int32_t next_int(char **ptr, int64_t *val) {
+int32_t next_int(char **ptr, char *end, int64_t *val) {
   if (*(*ptr)++ != 'i') {
     fprintf(stderr, "Invalid integer encoding\n");
     return 1;
   }
   char *begin = *ptr;
-  if (*begin == '-')
+  if (*ptr < end && *begin == '-')
     ++*ptr;
-  for (; **ptr != 'e' && **ptr != '\0'; ++*ptr) {
+  for (; *ptr < end && **ptr != 'e'; ++*ptr) {
     if (!is_digit(**ptr)) {
       fprintf(stderr, "Not an integer - invalid character\n");
       return 1;
     }
   }
-  if (**ptr != 'e') {
+  if (*ptr == end) {
     fprintf(stderr, "No end delimiter found\n");
     return 1;
   }
@@ -201,9 +220,9 @@ int32_t next_int(char **ptr, int64_t *val) {
     fprintf(stderr, "Invalid integer\n");
     return 1;
   }
-  char *end;
-  int64_t i = strtoll(begin, &end, 10);
-  if (begin == end) {
+  char *last;
+  int64_t i = strtoll(begin, &last, 10);
+  if (begin == last) {
     fprintf(stderr, "No digits found\n");
     return 1;
   }
@@ -214,177 +233,442 @@ int32_t next_int(char **ptr, int64_t *val) {
   return 0;
 }
 
+// next_str, checking that the string ends within the input
+int32_t scan_str(char **ptr, char *end, bestring_t *str) {
+  if (next_str(ptr, end, str) != 0) {
+    return 1;
+  }
+  if (str->n < 0 || str->n > end - str->str) {
+    fprintf(stderr, "String runs past the end of input\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Check the value at *ptr and move past it without allocating. With a
+// non-NULL sc the element counts needed by be_build are recorded too.
+int32_t be_scan(char **ptr, char *end, bescan_t *sc, int32_t depth) {
+  if (*ptr >= end) {
+    fprintf(stderr, "Unexpected end of input\n");
+    return 1;
+  }
+  if (is_digit(**ptr)) {
+    bestring_t str;
+    return scan_str(ptr, end, &str);
+  }
+  if (**ptr == 'i') {
+    return next_int(ptr, end, NULL);
+  }
+  if (**ptr != 'l' && **ptr != 'd') {
+    fprintf(stderr, "Invalid type\n");
+    return 1;
+  }
+  if (depth == BE_MAX_DEPTH) {
+    fprintf(stderr, "Nesting too deep\n");
+    return 1;
+  }
+
+  bool is_dict = *(*ptr)++ == 'd';
+  uint32_t slot = 0;
+  if (sc != NULL) {
+    if (sc->nvecs == sc->cap) {
+      uint32_t cap = sc->cap == 0 ? 64 : 2 * sc->cap;
+      uint32_t *sizes = (uint32_t *)realloc(sc->sizes, cap * sizeof(uint32_t));
+      if (sizes == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+      }
+      sc->sizes = sizes;
+      sc->cap = cap;
+    }
+    slot = sc->nvecs++;
+  }
+  uint32_t len = 0;
+  while (*ptr < end && **ptr != 'e') {
+    bestring_t key;
+    if (is_dict && scan_str(ptr, end, &key) != 0) {
+      fprintf(stderr, "Failed to parse dict key\n");
+      return 1;
+    }
+    if (be_scan(ptr, end, sc, depth + 1) != 0) {
+      return 1;
+    }
+    ++len;
+  }
+  if (*ptr >= end) {
+    fprintf(stderr, "Invalid list - cannot find end delimiter\n");
+    return 1;
+  }
+  ++*ptr;
+  if (sc != NULL) {
+    sc->sizes[slot] = len;
+    if (is_dict) {
+      sc->nitems += len;
+    } else {
+      sc->nvalues += len;
+    }
+  }
+  return 0;
+}
+
+// Order dict keys as raw bytes, the order bencode requires.
+int32_t be_keycmp(bestring_t *key, char *str, int32_t n) {
+  int32_t c = memcmp(key->str, str, key->n < n ? key->n : n);
+  return c != 0 ? c : key->n - n;
+}
+
+int32_t be_itemcmp(const void *a, const void *b) {
+  bestring_t *kb = &((bedictitem_t *)b)->key;
+  return be_keycmp(&((bedictitem_t *)a)->key, kb->str, kb->n);
+}
+
+// Second pass over input already checked by be_scan. Dicts come out sorted
+// by key even when the input is not, so lookups can bisect.
+void be_build(char **ptr, bevalue_t *v, bescan_t *sc) {
+  if (is_digit(**ptr)) {
+    v->type = BE_STR;
+    next_str(ptr, sc->end, &v->val.str);
+    return;
+  }
+  if (**ptr == 'i') {
+    v->type = BE_INT;
+    next_int(ptr, sc->end, &v->val.i);
+    return;
+  }
+
+  bevec_t *vec = &v->val.vec;
+  v->type = BE_VEC;
+  vec->is_dict = *(*ptr)++ == 'd';
+  vec->len = vec->cap = sc->sizes[sc->nvecs++];
+  if (vec->is_dict) {
+    vec->data.dict = sc->items;
+    sc->items += vec->len;
+    for (int32_t i = 0; i < vec->len; ++i) {
+      next_str(ptr, sc->end, &vec->data.dict[i].key);
+      be_build(ptr, &vec->data.dict[i].val, sc);
+    }
+    for (int32_t i = 1; i < vec->len; ++i) {
+      if (be_itemcmp(&vec->data.dict[i - 1], &vec->data.dict[i]) > 0) {
+        qsort(vec->data.dict, vec->len, sizeof(bedictitem_t), be_itemcmp);
+        break;
+      }
+    }
+  } else {
+    vec->data.list = sc->values;
+    sc->values += vec->len;
+    for (int32_t i = 0; i < vec->len; ++i) {
+      be_build(ptr, &vec->data.list[i], sc);
+    }
+  }
+  ++*ptr;
+}
+
+// Decode the value at the start of the n bytes at buf. Anything after the
+// value is ignored.
+int32_t be_parse(char *buf, int64_t n, bedoc_t *doc) {
+  bescan_t sc = {0};
+  char *s = buf;
+  if (be_scan(&s, buf + n, &sc, 0) != 0) {
+    free(sc.sizes);
+    return 1;
+  }
+
+  size_t size =
+      sc.nvalues * sizeof(bevalue_t) + sc.nitems * sizeof(bedictitem_t);
+  doc->arena = malloc(size);
+  if (doc->arena == NULL && size != 0) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    free(sc.sizes);
+    return 1;
+  }
+  sc.values = (bevalue_t *)doc->arena;
+  sc.items = (bedictitem_t *)(sc.values + sc.nvalues);
+  sc.nvecs = 0;
+  sc.end = buf + n;
+  s = buf;
+  be_build(&s, &doc->root, &sc);
+  free(sc.sizes);
+  return 0;
+}
+
+void bedoc_free(bedoc_t *doc) { free(doc->arena); }
+
+// TODO: disambiguate error and key not found
+bevalue_t *bevec_dict_get(bevec_t *v, char *str) {
+  if (!v->is_dict) {
+    fprintf(stderr, "Not a dictionary\n");
+    return NULL;
+  }
+  int32_t n = strlen(str);
+  int32_t lo = 0, hi = v->len;
+  while (lo < hi) {
+    int32_t mid = lo + (hi - lo) / 2;
+    int32_t c = be_keycmp(&v->data.dict[mid].key, str, n);
+    if (c == 0) {
+      return &v->data.dict[mid].val;
+    }
+    if (c < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return NULL;
+}
+
 // TODO: disambiguate error and key not found
-char *dict_get_raw(char **ptr, char *str) {
+char *dict_get_raw(char **ptr, char *end, char *str) {
   if (*(*ptr)++ != 'd') {
     fprintf(stderr, "Not a dictionary\n");
     return NULL;
   }
 
-  while (**ptr != 'e' && **ptr != '\0') {
+  while (*ptr < end && **ptr != 'e') {
     bestring_t key;
 
-    if (next_str(ptr, &key) != 0) {
+    if (scan_str(ptr, end, &key) != 0) {
       fprintf(stderr, "Failed to parse dict key\n");
       return NULL;
     }
 
-    if (strncmp(key.str, str, key.n) == 0) {
+    if (be_keycmp(&key, str, strlen(str)) == 0) {
       return *ptr;
     }
 
-    bevalue_t v;
-    if (next_value(ptr, &v) != 0) {
+    if (be_scan(ptr, end, NULL, 0) != 0) {
       fprintf(stderr, "Failed to parse dict value\n");
       return NULL;
     }
-    bevalue_free(&v);
   }
 
   return NULL;
 }
 
-int32_t next_value(char **ptr, bevalue_t *beval) {
-  if (is_digit(**ptr)) {
-    bestring_t str;
-    bevalue_t v;
+typedef enum {
+  BE_EV_INT,
+  BE_EV_STR,
+  BE_EV_LIST,
+  BE_EV_DICT,
+  BE_EV_END,
+} beevent_t;
 
-    if (next_str(ptr, &str) != 0) {
-      fprintf(stderr, "Failed to parse string\n");
-      return 1;
-    }
-    v.type = BE_STR;
-    v.val.str = str;
-    *beval = v;
+typedef enum { BP_VALUE, BP_INT, BP_LEN, BP_STR, BP_DONE } bpstate_t;
 
-  } else if (**ptr == 'i') {
-    int64_t i;
-    bevalue_t v;
+typedef struct bepush_t bepush_t;
 
-    if (next_int(ptr, &i) != 0) {
-      fprintf(stderr, "Failed to parse integer\n");
-      return 1;
-    }
-    v.type = BE_INT;
-    v.val.i = i;
-    *beval = v;
+// Called for each value as soon as it is parsed, with depth set to the
+// number of containers around it. A string may arrive in several calls,
+// str_off and str_len tell where each chunk belongs. Non-zero stops the
+// parse.
+typedef int32_t (*bepush_fn_t)(bepush_t *p, beevent_t ev, char *data,
+                               uint32_t n);
 
-  } else if (**ptr == 'l') {
-    bevec_t vec;
-    bevalue_t v;
-    if (bevec_init(&vec, false) != 0) {
-      fprintf(stderr, "Failed to initialize vector\n");
-      return 1;
-    }
+// Push-style parser for bencode arriving in arbitrary chunks. It keeps no
+// copy of the input, only the path to the current value, so its memory use
+// is fixed whatever the size of the document.
+struct bepush_t {
+  bepush_fn_t fn;
+  void *ctx;
+  bpstate_t state;
+  int32_t depth;
+  char kind[32];       // 'l' or 'd' for each open container
+  char key[32][32];    // current key of each open dict
+  uint8_t key_len[32]; // larger than the buffer when a key did not fit
+  bool want_key;
+  bool in_key;
+  bool neg;
+  int32_t digits;
+  int64_t num;
+  int64_t str_off;
+  int64_t str_len;
+};
 
-    ++*ptr;
-    while (**ptr != 'e' && **ptr != '\0') {
-      bevalue_t val;
-      if (next_value(ptr, &val) != 0) {
-        fprintf(stderr, "Failed to parse next value\n");
+void bepush_init(bepush_t *p, bepush_fn_t fn, void *ctx) {
+  memset(p, 0, sizeof(bepush_t));
+  p->fn = fn;
+  p->ctx = ctx;
+  p->state = BP_VALUE;
+}
+
+// Whether the container at level is a dict whose current key is key.
+bool bepush_key_is(bepush_t *p, int32_t level, char *key) {
+  return p->kind[level] == 'd' && p->key_len[level] == strlen(key) &&
+         memcmp(p->key[level], key, p->key_len[level]) == 0;
+}
+
+void bepush_value_done(bepush_t *p) {
+  p->state = p->depth == 0 ? BP_DONE : BP_VALUE;
+  p->want_key = p->depth > 0 && p->kind[p->depth - 1] == 'd';
+}
+
+void bepush_str_done(bepush_t *p) {
+  if (p->in_key) {
+    p->want_key = false;
+    p->state = BP_VALUE;
+  } else {
+    bepush_value_done(p);
+  }
+}
+
+// Feed the next n bytes of input. Bytes after the end of the document are
+// ignored.
+int32_t bepush_feed(bepush_t *p, char *data, size_t n) {
+  for (size_t i = 0; i < n && p->state != BP_DONE;) {
+    char c = data[i];
+    switch (p->state) {
+    case BP_VALUE:
+      if (p->want_key && c != 'e' && !is_digit(c)) {
+        fprintf(stderr, "Invalid dict key\n");
         return 1;
       }
-      if (bevec_push(&vec, &val) != 0) {
-        fprintf(stderr, "Failed to insert element into vector\n");
+      if (is_digit(c)) {
+        p->state = BP_LEN;
+        p->in_key = p->want_key;
+        p->num = 0;
+        p->digits = 0;
+        break;
+      }
+      ++i;
+      if (c == 'i') {
+        p->state = BP_INT;
+        p->num = 0;
+        p->digits = 0;
+        p->neg = false;
+      } else if (c == 'l' || c == 'd') {
+        if (p->depth == sizeof(p->kind)) {
+          fprintf(stderr, "Nesting too deep\n");
+          return 1;
+        }
+        if (p->fn(p, c == 'd' ? BE_EV_DICT : BE_EV_LIST, NULL, 0) != 0) {
+          return 1;
+        }
+        p->kind[p->depth] = c;
+        p->key_len[p->depth++] = 0;
+        p->want_key = c == 'd';
+      } else if (c == 'e' && p->depth > 0 &&
+                 (p->kind[p->depth - 1] == 'l' || p->want_key)) {
+        --p->depth;
+        if (p->fn(p, BE_EV_END, NULL, 0) != 0) {
+          return 1;
+        }
+        bepush_value_done(p);
+      } else {
+        fprintf(stderr, "Invalid type\n");
         return 1;
       }
-    }
-    if (*(*ptr)++ == '\0') {
-      fprintf(stderr, "Invalid list - cannot find end delimiter\n");
-      return 1;
-    }
-
-    v.type = BE_VEC;
-    v.val.vec = vec;
-    *beval = v;
-
-  } else if (**ptr == 'd') {
-    bevec_t vec;
-    bevalue_t v;
-    if (bevec_init(&vec, true) != 0) {
-      fprintf(stderr, "Failed to initialize vector\n");
-      return 1;
-    }
+      break;
 
-    ++*ptr;
-    while (**ptr != 'e' && **ptr != '\0') {
-      bestring_t key;
-      if (next_str(ptr, &key) != 0) {
-        fprintf(stderr, "Failed to parse dict key\n");
+    case BP_INT:
+      ++i;
+      if (c == '-' && p->digits == 0 && !p->neg) {
+        p->neg = true;
+      } else if (is_digit(c) && p->digits < 18 &&
+                 (p->digits == 0 || p->num != 0)) {
+        p->num = p->num * 10 + (c - '0');
+        ++p->digits;
+      } else if (c == 'e' && p->digits > 0 && !(p->neg && p->num == 0)) {
+        p->num = p->neg ? -p->num : p->num;
+        if (p->fn(p, BE_EV_INT, NULL, 0) != 0) {
+          return 1;
+        }
+        bepush_value_done(p);
+      } else {
+        fprintf(stderr, "Invalid integer\n");
         return 1;
       }
+      break;
 
-      bevalue_t val;
-      if (next_value(ptr, &val) != 0) {
-        fprintf(stderr, "Failed to parse dict value\n");
+    case BP_LEN:
+      ++i;
+      if (is_digit(c) && p->digits < 18) {
+        p->num = p->num * 10 + (c - '0');
+        ++p->digits;
+        break;
+      }
+      if (c != ':') {
+        fprintf(stderr, "Invalid string encoding\n");
         return 1;
       }
+      p->state = BP_STR;
+      p->str_off = 0;
+      p->str_len = p->num;
+      if (p->in_key) {
+        int64_t cap = sizeof(p->key[0]) + 1;
+        p->key_len[p->depth - 1] = p->num < cap ? p->num : cap;
+      }
+      if (p->str_len == 0) {
+        if (!p->in_key && p->fn(p, BE_EV_STR, data + i, 0) != 0) {
+          return 1;
+        }
+        bepush_str_done(p);
+      }
+      break;
 
-      bedictitem_t pair;
-      pair.key = key;
-      pair.val = val;
-      if (bevec_push(&vec, &pair) != 0) {
-        fprintf(stderr, "Failed to insert element into vector\n");
+    case BP_STR: {
+      int64_t left = p->str_len - p->str_off;
+      uint32_t k = left < (int64_t)(n - i) ? left : n - i;
+      if (p->in_key) {
+        int64_t room = (int64_t)sizeof(p->key[0]) - p->str_off;
+        if (room > 0) {
+          memcpy(p->key[p->depth - 1] + p->str_off, data + i,
+                 k < room ? k : room);
+        }
+      } else if (p->fn(p, BE_EV_STR, data + i, k) != 0) {
         return 1;
       }
+      p->str_off += k;
+      i += k;
+      if (p->str_off == p->str_len) {
+        bepush_str_done(p);
+      }
+      break;
     }
-    if (*(*ptr)++ == '\0') {
-      fprintf(stderr, "Invalid list - cannot find end delimiter\n");
-      return 1;
-    }
-
-    v.type = BE_VEC;
-    v.val.vec = vec;
-    *beval = v;
 
-  } else {
-    fprintf(stderr, "Invalid type\n");
-    return 1;
+    case BP_DONE:
+      break;
+    }
   }
   return 0;
 }
 
-void be_print(bevalue_t *v, char **str) {
+void be_print(bevalue_t *v, FILE *f) {
   switch (v->type) {
   case BE_INT:
-    *str += sprintf(*str, "%ld", v->val.i);
+    fprintf(f, "%ld", v->val.i);
     break;
   case BE_STR:
-    *str += sprintf(*str, "\"%.*s\"", v->val.str.n, v->val.str.str);
+    fprintf(f, "\"%.*s\"", v->val.str.n, v->val.str.str);
     break;
   case BE_VEC:
     if (v->val.vec.is_dict) {
-      *(*str)++ = '{';
+      fputc('{', f);
       for (int32_t i = 0; i < v->val.vec.len; ++i) {
+        if (i != 0) {
+          fputc(',', f);
+        }
         // print key
         bevalue_t val;
         val.type = BE_STR;
         val.val.str = v->val.vec.data.dict[i].key;
-        be_print(&val, str);
+        be_print(&val, f);
         // print color
-        *(*str)++ = ':';
+        fputc(':', f);
         // print value
-        be_print(&v->val.vec.data.dict[i].val, str);
-        *(*str)++ = ',';
-      }
-      if (v->val.vec.len != 0) {
-        --*str;
+        be_print(&v->val.vec.data.dict[i].val, f);
       }
-      *(*str)++ = '}';
+      fputc('}', f);
     } else {
-      *(*str)++ = '[';
+      fputc('[', f);
       for (int32_t i = 0; i < v->val.vec.len; ++i) {
-        be_print(&v->val.vec.data.list[i], str);
-        *(*str)++ = ',';
+        if (i != 0) {
+          fputc(',', f);
+        }
+        be_print(&v->val.vec.data.list[i], f);
       }
-      if (v->val.vec.len != 0) {
-        --*str;
-      }
-      *(*str)++ = ']';
+      fputc(']', f);
     }
     break;
   }
-  **str = '\0';
 }
 
 void print_hex(uint8_t *s) {
@@ -399,526 +683,5613 @@ void print_ip(uint8_t *s) {
 }
 
 int32_t decode(char *s) {
-  bevalue_t v;
-  if (next_value(&s, &v) != 0) {
+  bedoc_t doc;
+  if (be_parse(s, strlen(s), &doc) != 0) {
     return 1;
   }
-  char buf[1024];
-  char *str = buf;
-  be_print(&v, &str);
-  printf("%s\n", buf);
-  bevalue_free(&v);
+  be_print(&doc.root, stdout);
+  printf("\n");
+  bedoc_free(&doc);
   return 0;
 }
 
-char *read_file(char *filename) {
-  // open file
-  FILE *f = fopen(filename, "r");
-  if (f == NULL) {
-    perror("Failed to open torrent file");
-    return NULL;
-  }
-
-  // read contents
-  fseek(f, 0, SEEK_END);
-  int64_t fsize = ftell(f);
-  fseek(f, 0, SEEK_SET);
-  char *buf = (char *)malloc((fsize + 1) * sizeof(char));
-  if (buf == NULL) {
-    fprintf(stderr, "Failed to allocate memory\n");
-    return NULL;
-  }
-  if (fread(buf, 1, fsize, f) != fsize) {
-    fprintf(stderr, "Error while reading file contents\n");
-    return NULL;
-  }
-  buf[fsize] = '\0';
-
-  // close file
-  fclose(f);
-  return buf;
-}
-
 void urlencode(uint8_t *str, int32_t n, char *buf) {
   for (int32_t i = 0; i < n; ++i) {
     buf += sprintf(buf, "%%%02x", str[i]);
   }
 }
 
-size_t write_data(void *buffer, size_t size, size_t nmemb, bestring_t *res) {
-  size_t realsize = size * nmemb;
+typedef struct {
+  char *path; // '/' separated, starting with the torrent's name
+  int64_t length;
+  int64_t offset; // of the file's first byte within the torrent's data
+} torrent_file_t;
 
-  char *new_str = (char *)realloc(res->str, res->n + realsize + 1);
-  if (new_str == NULL) {
-    fprintf(stderr, "Failed to reallocate memory\n");
-    return 0;
-  }
+// A .torrent compiled once into what the commands need. The file stays
+// mapped while this lives, as the decoded document points into it.
+typedef struct {
+  char *buf;
+  int64_t size;
+  bedoc_t doc;
+  bestring_t announce;   // empty if only announce-list is given
+  bevec_t *announce_list; // tiers of tracker URLs, or NULL
+  bestring_t name;
+  uint8_t info_hash[SHA_DIGEST_LENGTH];
+  char *info; // the bencoded info dict, what a magnet link fetches
+  int64_t info_len;
+  uint8_t *hashes;
+  uint32_t npieces;
+  uint32_t piece_length;
+  uint64_t total_length;
+  torrent_file_t *files;
+  int32_t nfiles;
+  bool multi_file; // info has a files list rather than a length
+} torrent_t;
 
-  res->str = new_str;
-  memcpy(res->str + res->n, buffer, realsize);
-  res->n += realsize;
-  res->str[res->n] = '\0';
+// Whether a path component can be used as a file name as it is.
+bool safe_component(bestring_t *c) {
+  return c->n != 0 && memchr(c->str, '/', c->n) == NULL &&
+         memchr(c->str, '\0', c->n) == NULL &&
+         !(c->n == 1 && c->str[0] == '.') &&
+         !(c->n == 2 && c->str[0] == '.' && c->str[1] == '.');
+}
 
-  return realsize;
+// Join the name and path components of a file, or take the name alone.
+// Components that would escape the download directory are refused.
+char *torrent_path(bestring_t *name, bevec_t *path) {
+  int32_t n = name->n + 1;
+  for (int32_t i = 0; path != NULL && i < path->len; ++i) {
+    if (path->data.list[i].type != BE_STR ||
+        !safe_component(&path->data.list[i].val.str)) {
+      fprintf(stderr, "Invalid path component\n");
+      return NULL;
+    }
+    n += path->data.list[i].val.str.n + 1;
+  }
+  char *s = (char *)malloc(n);
+  if (s == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return NULL;
+  }
+  char *p = s + sprintf(s, "%.*s", name->n, name->str);
+  for (int32_t i = 0; path != NULL && i < path->len; ++i) {
+    bestring_t *c = &path->data.list[i].val.str;
+    p += sprintf(p, "/%.*s", c->n, c->str);
+  }
+  return s;
 }
 
-int32_t parse(char *filename) {
-  char *buf = read_file(filename);
-  if (buf == NULL) {
-    fprintf(stderr, "Failed to read file\n");
-    return 1;
+int32_t torrent_files(torrent_t *t, bevec_t *info) {
+  bevalue_t *length_v = bevec_dict_get(info, "length");
+  bevalue_t *files_v = bevec_dict_get(info, "files");
+  if (length_v != NULL) {
+    if (length_v->type != BE_INT || length_v->val.i < 0) {
+      fprintf(stderr, "Invalid length key\n");
+      return 1;
+    }
+    t->files = (torrent_file_t *)malloc(sizeof(torrent_file_t));
+    if (t->files == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      return 1;
+    }
+    t->files[0].path = torrent_path(&t->name, NULL);
+    t->files[0].length = length_v->val.i;
+    t->files[0].offset = 0;
+    t->nfiles = 1;
+    t->multi_file = false;
+    t->total_length = length_v->val.i;
+    return t->files[0].path == NULL;
   }
-  char *s = buf;
-  bevalue_t v;
-  if (next_value(&s, &v) != 0) {
+
+  if (files_v == NULL || files_v->type != BE_VEC || files_v->val.vec.is_dict ||
+      files_v->val.vec.len == 0) {
+    fprintf(stderr, "Invalid files key\n");
     return 1;
   }
-  if (v.type != BE_VEC && !v.val.vec.is_dict) {
-    fprintf(stderr, "Not a dictionary\n");
+  bevec_t *files = &files_v->val.vec;
+  t->multi_file = true;
+  t->files = (torrent_file_t *)calloc(files->len, sizeof(torrent_file_t));
+  if (t->files == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
     return 1;
   }
+  t->total_length = 0;
+  for (int32_t i = 0; i < files->len; ++i) {
+    bevalue_t *file_v = &files->data.list[i];
+    if (file_v->type != BE_VEC || !file_v->val.vec.is_dict) {
+      fprintf(stderr, "Invalid file entry\n");
+      return 1;
+    }
+    bevalue_t *len_v = bevec_dict_get(&file_v->val.vec, "length");
+    bevalue_t *path_v = bevec_dict_get(&file_v->val.vec, "path");
+    if (len_v == NULL || len_v->type != BE_INT || len_v->val.i < 0 ||
+        path_v == NULL || path_v->type != BE_VEC || path_v->val.vec.is_dict ||
+        path_v->val.vec.len == 0) {
+      fprintf(stderr, "Invalid file entry\n");
+      return 1;
+    }
+    t->files[i].length = len_v->val.i;
+    t->files[i].offset = t->total_length;
+    t->files[i].path = torrent_path(&t->name, &path_v->val.vec);
+    t->nfiles = i + 1;
+    if (t->files[i].path == NULL) {
+      return 1;
+    }
+    t->total_length += len_v->val.i;
+  }
+  return 0;
+}
+
+void torrent_close(torrent_t *t) {
+  for (int32_t i = 0; i < t->nfiles; ++i) {
+    free(t->files[i].path);
+  }
+  free(t->files);
+  bedoc_free(&t->doc);
+  munmap(t->buf, t->size);
+}
+
+// Decode the mapped .torrent in one pass and pull out everything the
+// commands use, hashing the info dict while its bytes are at hand. The
+// torrent is closed if it is not valid.
+int32_t torrent_decode(torrent_t *t) {
+  t->files = NULL;
+  t->nfiles = 0;
+  t->doc.arena = NULL;
+  if (be_parse(t->buf, t->size, &t->doc) != 0) {
+    goto fail;
+  }
 
-  bevalue_t *announce_v = bevec_dict_get(&v.val.vec, "announce");
-  if (announce_v == NULL || announce_v->type != BE_STR) {
+  bevalue_t *v = &t->doc.root;
+  if (v->type != BE_VEC || !v->val.vec.is_dict) {
+    fprintf(stderr, "Not a dictionary\n");
+    goto fail;
+  }
+  // entries of announce-list that are not lists of strings are skipped
+  // when announcing
+  bevalue_t *list_v = bevec_dict_get(&v->val.vec, "announce-list");
+  t->announce_list = list_v != NULL && list_v->type == BE_VEC &&
+                             !list_v->val.vec.is_dict && list_v->val.vec.len > 0
+                         ? &list_v->val.vec
+                         : NULL;
+  bevalue_t *announce_v = bevec_dict_get(&v->val.vec, "announce");
+  if (announce_v != NULL && announce_v->type == BE_STR) {
+    t->announce = announce_v->val.str;
+  } else if (announce_v == NULL) {
+    // trackerless, peers come from elsewhere
+    t->announce = (bestring_t){.str = "", .n = 0};
+  } else {
     fprintf(stderr, "Invalid announce key\n");
-    return 1;
+    goto fail;
   }
 
-  bevalue_t *info_v = bevec_dict_get(&v.val.vec, "info");
+  bevalue_t *info_v = bevec_dict_get(&v->val.vec, "info");
   if (info_v == NULL || info_v->type != BE_VEC || !info_v->val.vec.is_dict) {
     fprintf(stderr, "Invalid info key\n");
-    return 1;
+    goto fail;
   }
-
-  bevalue_t *length_v = bevec_dict_get(&info_v->val.vec, "length");
-  if (length_v == NULL || length_v->type != BE_INT) {
-    fprintf(stderr, "Invalid length key\n");
-    return 1;
+  bevec_t *info = &info_v->val.vec;
+  bevalue_t *name_v = bevec_dict_get(info, "name");
+  if (name_v == NULL || name_v->type != BE_STR) {
+    fprintf(stderr, "Invalid name key\n");
+    goto fail;
   }
-
-  bevalue_t *piece_length_v = bevec_dict_get(&info_v->val.vec, "piece length");
-  if (piece_length_v == NULL || piece_length_v->type != BE_INT) {
+  t->name = name_v->val.str;
+  bevalue_t *piece_length_v = bevec_dict_get(info, "piece length");
+  if (piece_length_v == NULL || piece_length_v->type != BE_INT ||
+      piece_length_v->val.i <= 0 || piece_length_v->val.i > INT32_MAX) {
     fprintf(stderr, "Invalid piece length key\n");
-    return 1;
+    goto fail;
   }
-
-  bevalue_t *pieces_v = bevec_dict_get(&info_v->val.vec, "pieces");
-  if (pieces_v == NULL || pieces_v->type != BE_STR) {
+  t->piece_length = piece_length_v->val.i;
+  bevalue_t *pieces_v = bevec_dict_get(info, "pieces");
+  if (pieces_v == NULL || pieces_v->type != BE_STR ||
+      pieces_v->val.str.n % SHA_DIGEST_LENGTH != 0) {
     fprintf(stderr, "Invalid pieces key\n");
-    return 1;
+    goto fail;
   }
-
-  s = buf;
-  char *raw_info_v = dict_get_raw(&s, "info");
-  if (raw_info_v == NULL) {
-    fprintf(stderr, "Unable to find info key\n");
-    return 1;
+  t->hashes = (uint8_t *)pieces_v->val.str.str;
+  t->npieces = pieces_v->val.str.n / SHA_DIGEST_LENGTH;
+  if (torrent_files(t, info) != 0) {
+    goto fail;
   }
-  bevalue_t v2;
-  if (next_value(&s, &v2) != 0) {
-    fprintf(stderr, "Failed to parse dict value\n");
-    return 1;
+  if (t->npieces != (t->total_length + t->piece_length - 1) / t->piece_length) {
+    fprintf(stderr, "Piece count does not match the length\n");
+    goto fail;
   }
-  bevalue_free(&v2);
-  int32_t n = s - raw_info_v;
-  uint8_t sha[SHA_DIGEST_LENGTH];
-  SHA1((uint8_t *)raw_info_v, n, (uint8_t *)sha);
 
-  printf("Tracker URL: %.*s\n", announce_v->val.str.n, announce_v->val.str.str);
-  printf("Length: %ld\n", length_v->val.i);
+  char *s = t->buf;
+  char *end = t->buf + t->size;
+  char *raw_info_v = dict_get_raw(&s, end, "info");
+  if (raw_info_v == NULL || be_scan(&s, end, NULL, 0) != 0) {
+    fprintf(stderr, "Invalid info key\n");
+    goto fail;
+  }
+  t->info = raw_info_v;
+  t->info_len = s - raw_info_v;
+  SHA1((uint8_t *)t->info, t->info_len, t->info_hash);
+  return 0;
+
+fail:
+  torrent_close(t);
+  return 1;
+}
+
+// Map a .torrent and decode it.
+int32_t torrent_open(torrent_t *t, char *filename) {
+  int32_t fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror("Failed to open torrent file");
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    fprintf(stderr, "Empty torrent file\n");
+    close(fd);
+    return 1;
+  }
+  t->size = st.st_size;
+  t->buf = (char *)mmap(NULL, t->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (t->buf == MAP_FAILED) {
+    perror("Failed to map torrent file");
+    return 1;
+  }
+  return torrent_decode(t);
+}
+
+int32_t parse(char *filename) {
+  torrent_t t;
+  if (torrent_open(&t, filename) != 0) {
+    return 1;
+  }
+
+  printf("Tracker URL: %.*s\n", t.announce.n, t.announce.str);
+  bevec_t *tiers = t.announce_list;
+  for (int32_t i = 0; tiers != NULL && i < tiers->len; ++i) {
+    bevalue_t *tier = &tiers->data.list[i];
+    if (tier->type != BE_VEC || tier->val.vec.is_dict) {
+      continue;
+    }
+    printf("Tier %d:", i + 1);
+    for (int32_t j = 0; j < tier->val.vec.len; ++j) {
+      bevalue_t *url = &tier->val.vec.data.list[j];
+      if (url->type == BE_STR) {
+        printf(" %.*s", url->val.str.n, url->val.str.str);
+      }
+    }
+    printf("\n");
+  }
+  printf("Length: %ld\n", t.total_length);
   printf("Info Hash: ");
-  print_hex(sha);
-  printf("Piece Length: %ld\n", piece_length_v->val.i);
+  print_hex(t.info_hash);
+  printf("Piece Length: %d\n", t.piece_length);
   printf("Piece Hashes:\n");
-  uint8_t *ptr = (uint8_t *)pieces_v->val.str.str;
-  for (int32_t i = 0; i < pieces_v->val.str.n; i += SHA_DIGEST_LENGTH) {
-    print_hex(ptr);
-    ptr += SHA_DIGEST_LENGTH;
+  for (uint32_t i = 0; i < t.npieces; ++i) {
+    print_hex(t.hashes + i * SHA_DIGEST_LENGTH);
+  }
+  if (t.multi_file) {
+    printf("Files:\n");
+    for (int32_t i = 0; i < t.nfiles; ++i) {
+      printf("%d: %s (%ld bytes)\n", i, t.files[i].path, t.files[i].length);
+    }
+  }
+
+  torrent_close(&t);
+  return 0;
+}
+
+// Announces to the torrent's trackers. Each tier of the announce-list is
+// announced in parallel, trying its URLs in turn until one answers (BEP 12),
+// and again whenever the tracker's interval comes round. HTTP announces run
+// through the curl multi socket interface and UDP ones (BEP 15) over
+// non-blocking sockets, all in an epoll set of their own that the caller's
+// loop can watch. HTTP replies are parsed as they arrive so peers are
+// handed out before the whole body is in.
+typedef struct tracker_t tracker_t;
+
+typedef enum {
+  TIER_IDLE,      // waiting for next_us
+  TIER_HTTP,      // transfer in flight
+  TIER_RESOLVING, // looking up a UDP tracker's host
+  TIER_CONNECT,   // UDP connect request sent
+  TIER_ANNOUNCE,  // UDP announce request sent
+} tierstate_t;
+
+// Host lookup for a UDP tracker. It lives apart from its tier, as a lookup
+// that cannot be cancelled still writes to it after the tier is gone.
+typedef struct {
+  struct gaicb req;
+  struct addrinfo hints;
+  char host[256];
+  char service[6];
+} lookup_t;
+
+typedef struct {
+  tracker_t *tr;
+  char **urls;
+  int32_t nurls;
+  int32_t current; // URL being tried
+  int32_t tried;   // URLs that failed in this round
+  tierstate_t state;
+  int64_t next_us; // when the next announce is due
+  uint32_t fails;  // rounds in a row without an answer
+  bool started;    // a tracker has seen the started event
+  int64_t interval;
+  char failure[256];
+
+  // HTTP
+  CURL *easy;
+  bepush_t parser;
+  // a compact peer split across chunks
+  uint8_t partial[6];
+  uint32_t npartial;
+  // fields of a peer in the dictionary model
+  char ip[46];
+  int64_t port;
+
+  // UDP
+  lookup_t *lookup;
+  int32_t fd;
+  uint32_t transaction;
+  uint64_t connection; // as the tracker sent it
+  int64_t connected_us;
+  uint32_t attempt; // retransmissions of the current request
+  int64_t retry_us;
+} tier_t;
+
+struct tracker_t {
+  CURLM *multi;
+  int32_t epfd;
+  int64_t timer_us; // when curl next wants to run, -1 if never
+  bool running;     // a round of announces is under way
+  bool answered;    // some tracker answered
+  tier_t *tiers;
+  int32_t ntiers;
+  uint8_t info_hash[SHA_DIGEST_LENGTH];
+  uint8_t id[20];
+  uint32_t key;
+  uint16_t port;
+  // reported with each announce, kept current by the caller
+  int64_t left;
+  uint64_t downloaded;
+  uint64_t uploaded;
+  void (*on_peer)(void *ctx, uint8_t *info);
+  void *ctx;
+  uint32_t npeers;
+};
+
+void tracker_emit(tracker_t *tr, uint8_t *info) {
+  tr->on_peer(tr->ctx, info);
+  ++tr->npeers;
+}
+
+// Copy a string value, which may arrive in pieces, into a NUL terminated
+// buffer, cutting it short if it does not fit.
+void tracker_copy(bepush_t *bp, char *buf, uint32_t size, char *data,
+                  uint32_t n) {
+  if (bp->str_off < size - 1) {
+    uint32_t k = min(n, size - 1 - bp->str_off);
+    memcpy(buf + bp->str_off, data, k);
+    buf[bp->str_off + k] = '\0';
+  }
+}
+
+int32_t tracker_on_value(bepush_t *bp, beevent_t ev, char *data, uint32_t n) {
+  tier_t *tier = (tier_t *)bp->ctx;
+  bool peers = bp->depth > 0 && bepush_key_is(bp, 0, "peers");
+
+  if (bp->depth == 1 && peers && ev == BE_EV_STR) {
+    // compact model, six bytes per peer
+    uint8_t *s = (uint8_t *)data;
+    while (n > 0 && (tier->npartial > 0 || n < 6)) {
+      tier->partial[tier->npartial++] = *s++;
+      --n;
+      if (tier->npartial == 6) {
+        tracker_emit(tier->tr, tier->partial);
+        tier->npartial = 0;
+      }
+    }
+    for (; n >= 6; s += 6, n -= 6) {
+      tracker_emit(tier->tr, s);
+    }
+    memcpy(tier->partial, s, n);
+    tier->npartial += n;
+  } else if (bp->depth == 1 && bepush_key_is(bp, 0, "failure reason") &&
+             ev == BE_EV_STR) {
+    tracker_copy(bp, tier->failure, sizeof(tier->failure), data, n);
+  } else if (bp->depth == 1 && bepush_key_is(bp, 0, "interval") &&
+             ev == BE_EV_INT) {
+    tier->interval = bp->num;
+  } else if (bp->depth == 2 && peers && bp->kind[1] == 'l') {
+    // dictionary model, one dict with ip and port per peer
+    if (ev == BE_EV_DICT) {
+      tier->ip[0] = '\0';
+      tier->port = -1;
+    } else if (ev == BE_EV_END && bp->kind[2] == 'd') {
+      uint8_t info[6];
+      if (inet_pton(AF_INET, tier->ip, info) == 1 && tier->port > 0 &&
+          tier->port < 65536) {
+        info[4] = tier->port >> 8;
+        info[5] = tier->port & 0xff;
+        tracker_emit(tier->tr, info);
+      }
+    }
+  } else if (bp->depth == 3 && peers && bp->kind[1] == 'l') {
+    if (bepush_key_is(bp, 2, "ip") && ev == BE_EV_STR) {
+      tracker_copy(bp, tier->ip, sizeof(tier->ip), data, n);
+    } else if (bepush_key_is(bp, 2, "port") && ev == BE_EV_INT) {
+      tier->port = bp->num;
+    }
+  }
+  return 0;
+}
+
+size_t tracker_on_data(void *buffer, size_t size, size_t nmemb,
+                       tier_t *tier) {
+  size_t realsize = size * nmemb;
+  if (bepush_feed(&tier->parser, (char *)buffer, realsize) != 0) {
+    fprintf(stderr, "Invalid tracker response\n");
+    return 0;
+  }
+  return realsize;
+}
+
+int tracker_on_socket(CURL *easy, curl_socket_t s, int what, void *userp,
+                      void *socketp) {
+  tracker_t *tr = (tracker_t *)userp;
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl(tr->epfd, EPOLL_CTL_DEL, s, NULL);
+    return 0;
+  }
+  struct epoll_event ev = {
+      .events = (what & CURL_POLL_IN ? EPOLLIN : 0) |
+                (what & CURL_POLL_OUT ? EPOLLOUT : 0),
+      .data.fd = s,
+  };
+  if (epoll_ctl(tr->epfd, EPOLL_CTL_MOD, s, &ev) != 0 &&
+      epoll_ctl(tr->epfd, EPOLL_CTL_ADD, s, &ev) != 0) {
+    perror("Failed to register tracker socket");
+    return -1;
+  }
+  return 0;
+}
+
+int tracker_on_timer(CURLM *multi, long timeout_ms, void *userp) {
+  tracker_t *tr = (tracker_t *)userp;
+  tr->timer_us = timeout_ms < 0 ? -1 : now_us() + timeout_ms * 1000;
+  return 0;
+}
+
+// End the tier's announce. After an answer the next one is due when the
+// tracker's interval is up, and the URL that answered is tried first from
+// then on. After a failure the tier's next URL is tried right away, and once
+// all of them failed the tier backs off.
+void tier_done(tracker_t *tr, tier_t *tier, bool ok) {
+  if (tier->state == TIER_HTTP) {
+    curl_multi_remove_handle(tr->multi, tier->easy);
+  }
+  if (tier->fd >= 0) {
+    close(tier->fd);
+    tier->fd = -1;
+  }
+  tier->state = TIER_IDLE;
+  int64_t now = now_us();
+  if (ok) {
+    tr->answered = true;
+    tier->started = true;
+    tier->fails = 0;
+    tier->tried = 0;
+    char *url = tier->urls[tier->current];
+    memmove(tier->urls + 1, tier->urls, tier->current * sizeof(char *));
+    tier->urls[0] = url;
+    tier->current = 0;
+    int64_t interval = tier->interval <= 0 ? ANNOUNCE_INTERVAL
+                       : tier->interval < MIN_ANNOUNCE_INTERVAL
+                           ? MIN_ANNOUNCE_INTERVAL
+                           : tier->interval;
+    tier->next_us = now + interval * 1000000;
+    return;
+  }
+  tier->current = (tier->current + 1) % tier->nurls;
+  if (++tier->tried < tier->nurls) {
+    tier->next_us = now;
+    return;
+  }
+  tier->tried = 0;
+  int64_t wait = (int64_t)ANNOUNCE_RETRY << min(tier->fails++, 8);
+  tier->next_us =
+      now + (wait < ANNOUNCE_INTERVAL ? wait : ANNOUNCE_INTERVAL) * 1000000;
+}
+
+int32_t tier_http_start(tracker_t *tr, tier_t *tier) {
+  if (tier->easy == NULL && (tier->easy = curl_easy_init()) == NULL) {
+    fprintf(stderr, "Failed to set up tracker request\n");
+    return 1;
+  }
+  char *url = tier->urls[tier->current];
+  char enc_id[61], enc_hash[61];
+  urlencode(tr->info_hash, SHA_DIGEST_LENGTH, enc_hash);
+  urlencode(tr->id, 20, enc_id);
+  const char *fmt = "%s%cinfo_hash=%s&peer_id=%s&port=%d&uploaded=%lu&"
+                    "downloaded=%lu&left=%ld&compact=1&key=%08x%s";
+  char sep = strchr(url, '?') != NULL ? '&' : '?';
+  char *event = tier->started ? "" : "&event=started";
+  int32_t n = snprintf(NULL, 0, fmt, url, sep, enc_hash, enc_id, tr->port,
+                       tr->uploaded, tr->downloaded, tr->left, tr->key, event);
+  char *full = (char *)malloc(n + 1);
+  if (full == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  snprintf(full, n + 1, fmt, url, sep, enc_hash, enc_id, tr->port,
+           tr->uploaded, tr->downloaded, tr->left, tr->key, event);
+  // curl keeps a copy
+  curl_easy_setopt(tier->easy, CURLOPT_URL, full);
+  free(full);
+  curl_easy_setopt(tier->easy, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(tier->easy, CURLOPT_WRITEFUNCTION, tracker_on_data);
+  curl_easy_setopt(tier->easy, CURLOPT_WRITEDATA, tier);
+  curl_easy_setopt(tier->easy, CURLOPT_PRIVATE, tier);
+  bepush_init(&tier->parser, tracker_on_value, tier);
+  tier->npartial = 0;
+  if (curl_multi_add_handle(tr->multi, tier->easy) != CURLM_OK) {
+    fprintf(stderr, "Failed to set up tracker request\n");
+    return 1;
+  }
+  tier->state = TIER_HTTP;
+  return 0;
+}
+
+// Start looking up the host of a udp://host:port tracker URL.
+int32_t tier_udp_start(tracker_t *tr, tier_t *tier) {
+  char *host = tier->urls[tier->current] + strlen("udp://");
+  char *colon = strchr(host, ':');
+  char *end = NULL;
+  long port = colon != NULL ? strtol(colon + 1, &end, 10) : 0;
+  if (colon == NULL || colon == host || colon - host >= 256 || port <= 0 ||
+      port > 65535 || (*end != '\0' && *end != '/')) {
+    fprintf(stderr, "Invalid tracker URL: %s\n", tier->urls[tier->current]);
+    return 1;
+  }
+  lookup_t *l = (lookup_t *)calloc(1, sizeof(lookup_t));
+  if (l == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  memcpy(l->host, host, colon - host);
+  sprintf(l->service, "%ld", port);
+  l->hints.ai_family = AF_INET;
+  l->hints.ai_socktype = SOCK_DGRAM;
+  l->req.ar_name = l->host;
+  l->req.ar_service = l->service;
+  l->req.ar_request = &l->hints;
+  struct gaicb *reqs[] = {&l->req};
+  if (getaddrinfo_a(GAI_NOWAIT, reqs, 1, NULL) != 0) {
+    fprintf(stderr, "Failed to look up tracker host %s\n", l->host);
+    free(l);
+    return 1;
+  }
+  tier->lookup = l;
+  tier->state = TIER_RESOLVING;
+  return 0;
+}
+
+// Send the request the tier's UDP exchange is at, a connect or an
+// announce, under a new transaction ID, and set when to give up waiting.
+int32_t tier_udp_send(tracker_t *tr, tier_t *tier) {
+  uint8_t msg[98];
+  uint32_t n = 16;
+  RAND_bytes((uint8_t *)&tier->transaction, sizeof(tier->transaction));
+  if (tier->state == TIER_CONNECT) {
+    *(uint64_t *)msg = htobe64(UDP_PROTOCOL_ID);
+    *(uint32_t *)(msg + 8) = htonl(0);
+  } else {
+    *(uint64_t *)msg = tier->connection;
+    *(uint32_t *)(msg + 8) = htonl(1);
+    memcpy(msg + 16, tr->info_hash, SHA_DIGEST_LENGTH);
+    memcpy(msg + 36, tr->id, 20);
+    *(uint64_t *)(msg + 56) = htobe64(tr->downloaded);
+    *(uint64_t *)(msg + 64) = htobe64(tr->left);
+    *(uint64_t *)(msg + 72) = htobe64(tr->uploaded);
+    *(uint32_t *)(msg + 80) = htonl(tier->started ? 0 : 2);
+    *(uint32_t *)(msg + 84) = 0; // our address as the tracker sees it
+    *(uint32_t *)(msg + 88) = htonl(tr->key);
+    *(uint32_t *)(msg + 92) = htonl(-1); // as many peers as it likes
+    *(uint16_t *)(msg + 96) = htons(tr->port);
+    n = 98;
+  }
+  *(uint32_t *)(msg + 12) = tier->transaction;
+  tier->retry_us = now_us() + (UDP_TIMEOUT * 1000000LL << tier->attempt);
+  if (send(tier->fd, msg, n, 0) != n) {
+    fprintf(stderr, "Tracker request failed: %s\n", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+// Open a socket to the tracker once its host is looked up, and connect.
+int32_t tier_udp_resolved(tracker_t *tr, tier_t *tier) {
+  lookup_t *l = tier->lookup;
+  int32_t err = gai_error(&l->req);
+  if (err == EAI_INPROGRESS) {
+    return 0;
+  }
+  tier->lookup = NULL;
+  struct addrinfo *ai = l->req.ar_result;
+  if (err != 0 || ai == NULL) {
+    fprintf(stderr, "Failed to look up tracker host %s: %s\n", l->host,
+            gai_strerror(err));
+    free(l);
+    return 1;
+  }
+  tier->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  // connected so only the tracker's datagrams reach us
+  bool ok =
+      tier->fd >= 0 && connect(tier->fd, ai->ai_addr, ai->ai_addrlen) == 0;
+  freeaddrinfo(ai);
+  free(l);
+  struct epoll_event ev = {.events = EPOLLIN, .data.fd = tier->fd};
+  if (!ok || epoll_ctl(tr->epfd, EPOLL_CTL_ADD, tier->fd, &ev) != 0) {
+    perror("Failed to open tracker socket");
+    return 1;
+  }
+  tier->state = TIER_CONNECT;
+  tier->attempt = 0;
+  return tier_udp_send(tr, tier);
+}
+
+// Take the tracker's replies, moving from connect to announce and handing
+// out the peers of the announce reply.
+void tier_udp_readable(tracker_t *tr, tier_t *tier) {
+  uint8_t buf[8192];
+  for (;;) {
+    ssize_t n = recv(tier->fd, buf, sizeof(buf), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (n < 0) {
+      fprintf(stderr, "Tracker request failed: %s\n", strerror(errno));
+      tier_done(tr, tier, false);
+      return;
+    }
+    if (n < 8 || *(uint32_t *)(buf + 4) != tier->transaction) {
+      continue; // a late reply to a request we sent again
+    }
+    uint32_t action = ntohl(*(uint32_t *)buf);
+    if (action == 3) {
+      fprintf(stderr, "Tracker refused the announce: %.*s\n", (int)n - 8,
+              buf + 8);
+      tier_done(tr, tier, false);
+      return;
+    }
+    if (tier->state == TIER_CONNECT && action == 0 && n >= 16) {
+      memcpy(&tier->connection, buf + 8, 8);
+      tier->connected_us = now_us();
+      tier->state = TIER_ANNOUNCE;
+      tier->attempt = 0;
+      if (tier_udp_send(tr, tier) != 0) {
+        tier_done(tr, tier, false);
+        return;
+      }
+    } else if (tier->state == TIER_ANNOUNCE && action == 1 && n >= 20) {
+      tier->interval = ntohl(*(uint32_t *)(buf + 8));
+      for (ssize_t off = 20; off + 6 <= n; off += 6) {
+        tracker_emit(tr, buf + off);
+      }
+      tier_done(tr, tier, true);
+      return;
+    }
+  }
+}
+
+// Send the request again if the tracker has not answered in time, doubling
+// the wait each time, and give up after UDP_RETRIES.
+void tier_udp_timeout(tracker_t *tr, tier_t *tier) {
+  if (++tier->attempt > UDP_RETRIES) {
+    fprintf(stderr, "Tracker timed out: %s\n", tier->urls[tier->current]);
+    tier_done(tr, tier, false);
+    return;
+  }
+  // a connection ID is only good for a minute
+  if (tier->state == TIER_ANNOUNCE &&
+      now_us() - tier->connected_us >= UDP_CONNECTION_TTL * 1000000LL) {
+    tier->state = TIER_CONNECT;
+  }
+  if (tier_udp_send(tr, tier) != 0) {
+    tier_done(tr, tier, false);
+  }
+}
+
+void tier_start(tracker_t *tr, tier_t *tier) {
+  char *url = tier->urls[tier->current];
+  tier->interval = 0;
+  tier->failure[0] = '\0';
+  int32_t ret;
+  if (strncmp(url, "udp://", 6) == 0) {
+    ret = tier_udp_start(tr, tier);
+  } else if (strncmp(url, "http://", 7) == 0 ||
+             strncmp(url, "https://", 8) == 0) {
+    ret = tier_http_start(tr, tier);
+  } else {
+    fprintf(stderr, "Unsupported tracker URL: %s\n", url);
+    ret = 1;
+  }
+  if (ret != 0) {
+    tier_done(tr, tier, false);
+  }
+}
+
+// One tier per well-formed announce-list entry, its URLs shuffled as
+// BEP 12 asks, or a single tier for the announce URL without a list.
+int32_t tracker_add_tiers(tracker_t *tr, torrent_t *t) {
+  bevec_t *list = t->announce_list;
+  int32_t n = list != NULL ? list->len : 0;
+  tr->tiers = (tier_t *)calloc(n + 1, sizeof(tier_t));
+  if (tr->tiers == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  for (int32_t i = 0; i <= n; ++i) {
+    bevec_t *urls = NULL;
+    if (i < n) {
+      bevalue_t *e = &list->data.list[i];
+      if (e->type != BE_VEC || e->val.vec.is_dict || e->val.vec.len == 0) {
+        continue;
+      }
+      urls = &e->val.vec;
+    } else if (tr->ntiers != 0 || t->announce.n == 0) {
+      break;
+    }
+    tier_t *tier = &tr->tiers[tr->ntiers];
+    tier->urls = (char **)malloc((urls != NULL ? urls->len : 1) *
+                                 sizeof(char *));
+    if (tier->urls == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      return 1;
+    }
+    for (int32_t j = 0; urls != NULL && j < urls->len; ++j) {
+      bevalue_t *u = &urls->data.list[j];
+      if (u->type == BE_STR && u->val.str.n != 0) {
+        tier->urls[tier->nurls++] = strndup(u->val.str.str, u->val.str.n);
+      }
+    }
+    if (urls == NULL) {
+      tier->urls[tier->nurls++] = strndup(t->announce.str, t->announce.n);
+    }
+    for (int32_t j = tier->nurls - 1; j > 0; --j) {
+      uint32_t k;
+      RAND_bytes((uint8_t *)&k, sizeof(k));
+      k %= j + 1;
+      char *url = tier->urls[j];
+      tier->urls[j] = tier->urls[k];
+      tier->urls[k] = url;
+    }
+    tier->tr = tr;
+    tier->fd = -1;
+    if (tier->nurls == 0) {
+      free(tier->urls);
+      tier->urls = NULL;
+      continue;
+    }
+    ++tr->ntiers;
+  }
+  return 0;
+}
+
+// Start announcing. Nothing is sent until tracker_poll first runs. On
+// failure tr is still to be freed.
+int32_t tracker_start(tracker_t *tr, torrent_t *t, uint16_t port, int64_t left,
+                      void (*on_peer)(void *, uint8_t *), void *ctx) {
+  memset(tr, 0, sizeof(tracker_t));
+  tr->epfd = -1;
+  tr->on_peer = on_peer;
+  tr->ctx = ctx;
+  tr->timer_us = -1;
+  tr->port = port;
+  tr->left = left;
+  memcpy(tr->info_hash, t->info_hash, SHA_DIGEST_LENGTH);
+  if (RAND_bytes(tr->id, 20) != 1) {
+    fprintf(stderr, "Failed to generate peer id\n");
+    return 1;
+  }
+  RAND_bytes((uint8_t *)&tr->key, sizeof(tr->key));
+
+  tr->multi = curl_multi_init();
+  tr->epfd = epoll_create1(0);
+  if (tr->multi == NULL || tr->epfd < 0) {
+    fprintf(stderr, "Failed to set up tracker request\n");
+    return 1;
+  }
+  curl_multi_setopt(tr->multi, CURLMOPT_SOCKETFUNCTION, tracker_on_socket);
+  curl_multi_setopt(tr->multi, CURLMOPT_SOCKETDATA, tr);
+  curl_multi_setopt(tr->multi, CURLMOPT_TIMERFUNCTION, tracker_on_timer);
+  curl_multi_setopt(tr->multi, CURLMOPT_TIMERDATA, tr);
+  if (tracker_add_tiers(tr, t) != 0) {
+    return 1;
+  }
+  // without trackers the peers have to come from elsewhere
+  tr->running = tr->ntiers != 0;
+  return 0;
+}
+
+// Milliseconds the caller may sleep before tracker_poll is due, at most cap.
+int32_t tracker_timeout(tracker_t *tr, int32_t cap) {
+  int64_t now = now_us();
+  int64_t due = tr->timer_us >= 0 ? tr->timer_us : INT64_MAX;
+  for (int32_t i = 0; i < tr->ntiers; ++i) {
+    tier_t *tier = &tr->tiers[i];
+    if (tier->state == TIER_IDLE) {
+      due = min64(due, tier->next_us);
+    } else if (tier->state == TIER_RESOLVING) {
+      due = min64(due, now + LOOKUP_POLL);
+    } else if (tier->state != TIER_HTTP) {
+      due = min64(due, tier->retry_us);
+    }
+  }
+  if (due == INT64_MAX) {
+    return cap;
+  }
+  int64_t ms = (due - now + 999) / 1000;
+  return ms < 0 ? 0 : ms > cap ? cap : ms;
+}
+
+// Start the announces that are due, and let curl and the UDP exchanges
+// handle whatever their sockets and timers have for them.
+void tracker_poll(tracker_t *tr) {
+  int64_t now = now_us();
+  for (int32_t i = 0; i < tr->ntiers; ++i) {
+    if (tr->tiers[i].state == TIER_IDLE && now >= tr->tiers[i].next_us) {
+      tier_start(tr, &tr->tiers[i]);
+    }
+  }
+
+  int running;
+  struct epoll_event events[8];
+  int32_t n = epoll_wait(tr->epfd, events, 8, 0);
+  for (int32_t i = 0; i < n; ++i) {
+    tier_t *udp = NULL;
+    for (int32_t j = 0; j < tr->ntiers && udp == NULL; ++j) {
+      udp = tr->tiers[j].fd == events[i].data.fd ? &tr->tiers[j] : NULL;
+    }
+    if (udp != NULL) {
+      tier_udp_readable(tr, udp);
+      continue;
+    }
+    int32_t mask = (events[i].events & EPOLLIN ? CURL_CSELECT_IN : 0) |
+                   (events[i].events & EPOLLOUT ? CURL_CSELECT_OUT : 0) |
+                   (events[i].events & (EPOLLERR | EPOLLHUP) ? CURL_CSELECT_ERR
+                                                             : 0);
+    curl_multi_socket_action(tr->multi, events[i].data.fd, mask, &running);
+  }
+  if (tr->timer_us >= 0 && now_us() >= tr->timer_us) {
+    tr->timer_us = -1;
+    curl_multi_socket_action(tr->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+  }
+
+  int32_t left;
+  for (CURLMsg *msg; (msg = curl_multi_info_read(tr->multi, &left)) != NULL;) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+    tier_t *tier;
+    CURLcode result = msg->data.result;
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&tier);
+    bool ok = false;
+    if (result != CURLE_OK) {
+      fprintf(stderr, "Tracker request failed: %s\n",
+              curl_easy_strerror(result));
+    } else if (tier->parser.state != BP_DONE) {
+      fprintf(stderr, "Truncated tracker response\n");
+    } else if (tier->failure[0] != '\0') {
+      fprintf(stderr, "Tracker refused the announce: %s\n", tier->failure);
+    } else {
+      ok = true;
+    }
+    tier_done(tr, tier, ok);
+  }
+
+  now = now_us();
+  tr->running = false;
+  for (int32_t i = 0; i < tr->ntiers; ++i) {
+    tier_t *tier = &tr->tiers[i];
+    if (tier->state == TIER_RESOLVING && tier_udp_resolved(tr, tier) != 0) {
+      tier_done(tr, tier, false);
+    } else if ((tier->state == TIER_CONNECT ||
+                tier->state == TIER_ANNOUNCE) &&
+               now >= tier->retry_us) {
+      tier_udp_timeout(tr, tier);
+    }
+    // a tier with URLs left to try is still in its round
+    tr->running |= tier->state != TIER_IDLE || tier->tried != 0;
+  }
+}
+
+// Run the first announces on their own until a tracker hands out peers or
+// none is left to try.
+int32_t tracker_wait(tracker_t *tr) {
+  if (tr->ntiers == 0) {
+    fprintf(stderr, "No tracker to announce to\n");
+    return 1;
+  }
+  tracker_poll(tr);
+  while (tr->running && !(tr->answered && tr->npeers != 0)) {
+    struct epoll_event ev;
+    epoll_wait(tr->epfd, &ev, 1, tracker_timeout(tr, 1000));
+    tracker_poll(tr);
+  }
+  return tr->answered ? 0 : 1;
+}
+
+void tracker_free(tracker_t *tr) {
+  for (int32_t i = 0; i < tr->ntiers; ++i) {
+    tier_t *tier = &tr->tiers[i];
+    if (tier->state == TIER_HTTP) {
+      curl_multi_remove_handle(tr->multi, tier->easy);
+    }
+    curl_easy_cleanup(tier->easy);
+    if (tier->fd >= 0) {
+      close(tier->fd);
+    }
+    // a lookup under way cannot always be stopped, then it is left be
+    lookup_t *l = tier->lookup;
+    if (l != NULL && gai_cancel(&l->req) != EAI_NOTCANCELED) {
+      if (l->req.ar_result != NULL) {
+        freeaddrinfo(l->req.ar_result);
+      }
+      free(l);
+    }
+    for (int32_t j = 0; j < tier->nurls; ++j) {
+      free(tier->urls[j]);
+    }
+    free(tier->urls);
+  }
+  free(tr->tiers);
+  curl_multi_cleanup(tr->multi);
+  if (tr->epfd >= 0) {
+    close(tr->epfd);
+  }
+}
+
+int32_t recv_all(int32_t sockfd, uint8_t *buf, uint32_t n) {
+  for (uint32_t got = 0; got != n;) {
+    ssize_t r = recv(sockfd, buf + got, n - got, 0);
+    if (r <= 0) {
+      return 1;
+    }
+    got += r;
+  }
+  return 0;
+}
+
+void build_handshake(uint8_t *buf, uint8_t *hash, uint8_t *id) {
+  buf[0] = 19;
+  memcpy(buf + 1, "BitTorrent protocol", 19);
+  memset(buf + 20, 0, 8);
+  buf[25] = 0x10; // extension protocol
+  buf[27] = 0x04; // Fast Extension
+  memcpy(buf + 28, hash, 20);
+  memcpy(buf + 48, id, 20);
+}
+
+// Our extension protocol handshake (BEP 10), with its length prefix, into
+// buf of at least 64 bytes. ut_metadata is the one extension we speak, and
+// a nonzero metadata_size is the size of the info dict we can serve.
+uint32_t build_extended_handshake(uint8_t *buf, int64_t metadata_size) {
+  char *s = (char *)buf + 6;
+  s += sprintf(s, "d1:md11:ut_metadatai%dee", UT_METADATA_ID);
+  if (metadata_size != 0) {
+    s += sprintf(s, "13:metadata_sizei%lde", metadata_size);
+  }
+  s += sprintf(s, "e");
+  uint32_t n = s - (char *)buf;
+  *(uint32_t *)buf = htonl(n - 4);
+  buf[4] = 20;
+  buf[5] = 0;
+  return n;
+}
+
+// The header of a ut_metadata message into buf of at least 80 bytes, with a
+// length prefix that counts the n bytes of info dict that follow a data
+// message. total_size goes with data messages only.
+uint32_t build_metadata_message(uint8_t *buf, uint8_t id, int32_t type,
+                                uint32_t piece, int64_t total_size,
+                                uint32_t n) {
+  char *s = (char *)buf + 6;
+  s += sprintf(s, "d8:msg_typei%de5:piecei%ue", type, piece);
+  if (type == 1) {
+    s += sprintf(s, "10:total_sizei%lde", total_size);
+  }
+  s += sprintf(s, "e");
+  uint32_t len = s - (char *)buf;
+  *(uint32_t *)buf = htonl(len - 4 + n);
+  buf[4] = 20;
+  buf[5] = id;
+  return len;
+}
+
+// An integer value of a dict, false if it is missing or not an integer.
+bool be_dict_int(bevec_t *dict, char *key, int64_t *val) {
+  bevalue_t *v = dict->is_dict ? bevec_dict_get(dict, key) : NULL;
+  if (v == NULL || v->type != BE_INT) {
+    return false;
+  }
+  *val = v->val.i;
+  return true;
+}
+
+int32_t perform_handshake(int32_t sockfd, uint8_t *hash, uint8_t *data_buf) {
+  uint8_t id[20];
+  RAND_bytes(id, 20);
+
+  // perform handshake
+  build_handshake(data_buf, hash, id);
+  if (send(sockfd, data_buf, 68, 0) != 68) {
+    fprintf(stderr, "Failed to send handshake\n");
+    return 1;
+  }
+
+  // receive handshake, whose length is fixed once the protocol is ours
+  if (recv_all(sockfd, data_buf, 1) != 0) {
+    fprintf(stderr, "Failed to receive handshake\n");
+    return 1;
+  }
+  if (data_buf[0] != 19) {
+    fprintf(stderr, "Peer speaks a different protocol\n");
+    return 1;
+  }
+  if (recv_all(sockfd, data_buf + 1, 67) != 0) {
+    fprintf(stderr, "Failed to receive handshake\n");
+    return 1;
+  }
+  if (memcmp(data_buf + 28, hash, SHA_DIGEST_LENGTH) != 0) {
+    fprintf(stderr, "Peer serves a different torrent\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+void print_peer(void *ctx, uint8_t *info) { print_ip(info); }
+
+int32_t discover(char *filename) {
+  torrent_t t;
+  if (torrent_open(&t, filename) != 0) {
+    return 1;
+  }
+
+  tracker_t tr;
+  int32_t ret =
+      tracker_start(&tr, &t, DEFAULT_PORT, t.total_length, print_peer, NULL);
+  if (ret == 0) {
+    ret = tracker_wait(&tr);
+  }
+
+  tracker_free(&tr);
+  torrent_close(&t);
+  return ret;
+}
+
+int32_t handshake(char *filename, char *peer_info) {
+  torrent_t t;
+  if (torrent_open(&t, filename) != 0) {
+    return 1;
+  }
+
+  char *ip = peer_info;
+  char *port = strchr(peer_info, ':');
+  if (port == NULL) {
+    fprintf(stderr, "Peer must be given as <ip>:<port>\n");
+    torrent_close(&t);
+    return 1;
+  }
+  *port++ = '\0';
+
+  int32_t sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sockfd < 0) {
+    perror("Failed to create socket");
+    torrent_close(&t);
+    return 1;
+  }
+  struct sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(atoi(port));
+  addr.sin_addr.s_addr = inet_addr(ip);
+  // a dead peer must not hang us for the kernel's connect timeout, on
+  // Linux the send timeout bounds connect as well
+  struct timeval tv = {.tv_sec = CONNECT_TIMEOUT};
+  setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("Failed to connect to peer");
+    close(sockfd);
+    torrent_close(&t);
+    return 1;
+  }
+
+  uint8_t recv_buf[100] = {0};
+  uint8_t id[20] = {0};
+  if (perform_handshake(sockfd, t.info_hash, recv_buf) != 0) {
+    close(sockfd);
+    torrent_close(&t);
+    return 1;
+  }
+  close(sockfd);
+  memcpy(id, recv_buf + 48, 20);
+  printf("Peer ID: ");
+  print_hex(id);
+
+  torrent_close(&t);
+  return 0;
+}
+
+// Per-peer request pipeline. The queue depth tracks the bandwidth-delay
+// product of the connection: the delivery rate is measured over windows of
+// at least one round trip and multiplied by the smallest block round trip
+// seen so far, which excludes the queueing delay our own requests add.
+typedef struct {
+  uint32_t depth;
+  int64_t min_rtt_us;
+  double rate; // bytes per second
+  int64_t window_start_us;
+  uint64_t window_bytes;
+} pipeline_t;
+
+void pipeline_init(pipeline_t *p) {
+  p->depth = 4;
+  p->min_rtt_us = 0;
+  p->rate = 0;
+  p->window_start_us = now_us();
+  p->window_bytes = 0;
+}
+
+void pipeline_sample(pipeline_t *p, int64_t sent_us, uint32_t bytes) {
+  int64_t now = now_us();
+  int64_t rtt = now - sent_us;
+  if (p->min_rtt_us == 0 || rtt < p->min_rtt_us) {
+    p->min_rtt_us = rtt;
+  }
+
+  p->window_bytes += bytes;
+  int64_t elapsed = now - p->window_start_us;
+  if (elapsed <= 0 || elapsed < p->min_rtt_us) {
+    return;
+  }
+  double rate = p->window_bytes * 1e6 / elapsed;
+  // follow increases immediately so the queue can open up quickly, decay
+  // slowly on drops
+  p->rate = rate > p->rate ? rate : 0.875 * p->rate + 0.125 * rate;
+  p->window_start_us = now;
+  p->window_bytes = 0;
+
+  double bdp = p->rate * p->min_rtt_us / 1e6;
+  double depth = QUEUE_GAIN * bdp / BLOCK_SIZE + 1;
+  p->depth = depth > MAX_QUEUE_DEPTH ? MAX_QUEUE_DEPTH
+                                     : max((uint32_t)depth, MIN_QUEUE_DEPTH);
+}
+
+int32_t verify_piece(uint8_t *piece, uint32_t piece_size, uint8_t *hash) {
+  uint8_t md[20];
+  SHA1(piece, piece_size, md);
+  return memcmp(md, hash, 20) == 0 ? 0 : 1;
+}
+
+bool bitfield_has(uint8_t *bitfield, uint32_t i) {
+  return bitfield[i / 8] & 1 << (7 - i % 8);
+}
+
+void bitfield_set(uint8_t *bitfield, uint32_t i) {
+  bitfield[i / 8] |= 1 << (7 - i % 8);
+}
+
+// One output file and the range of the torrent's data it holds.
+typedef struct {
+  char *path; // NULL when the file is skipped
+  int32_t fd;
+  int64_t offset;
+  int64_t length;
+  uint8_t *map;
+} storage_file_t;
+
+// The output files, each preallocated once and written piece by piece at
+// each piece's own offset. A torrent offset is found among the files by
+// bisecting their start offsets, so placing a piece costs O(log files)
+// however many small files the torrent has. In mmap mode pieces are
+// copied into shared mappings instead and the kernel writes them back.
+// Read-only storage serves existing files for seeding as they are.
+typedef struct {
+  storage_file_t *files; // in offset order
+  int32_t nfiles;
+  int32_t cap;
+  bool use_mmap;
+  bool read_only;
+} storage_t;
+
+void storage_init(storage_t *st, bool use_mmap) {
+  st->files = NULL;
+  st->nfiles = 0;
+  st->cap = 0;
+  st->use_mmap = use_mmap;
+  st->read_only = false;
+
+  // torrents with thousands of files keep as many descriptors open
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+// Create the directories leading up to path.
+int32_t make_parents(char *path) {
+  char buf[strlen(path) + 1];
+  strcpy(buf, path);
+  for (char *s = strchr(buf + 1, '/'); s != NULL; s = strchr(s + 1, '/')) {
+    *s = '\0';
+    if (mkdir(buf, 0755) != 0 && errno != EEXIST) {
+      perror("Failed to create directory");
+      return 1;
+    }
+    *s = '/';
+  }
+  return 0;
+}
+
+// Add the file holding length bytes of the torrent's data from offset.
+// Files are added in offset order. A skipped file is not created, writes
+// to it are dropped.
+int32_t storage_add(storage_t *st, char *path, int64_t offset, int64_t length,
+                    bool skip) {
+  if (st->nfiles == st->cap) {
+    st->cap = st->cap == 0 ? 4 : 2 * st->cap;
+    st->files = (storage_file_t *)realloc(st->files,
+                                          st->cap * sizeof(storage_file_t));
+    if (st->files == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      return 1;
+    }
+  }
+  storage_file_t *f = &st->files[st->nfiles++];
+  f->path = NULL;
+  f->fd = -1;
+  f->offset = offset;
+  f->length = length;
+  f->map = NULL;
+  if (skip) {
+    return 0;
+  }
+
+  f->path = strdup(path);
+  if (st->read_only) {
+    // pieces past the end of a short file fail their check
+    f->fd = open(path, O_RDONLY);
+    if (f->fd < 0) {
+      perror("Failed to open file");
+      return 1;
+    }
+    // a short file is read, mapping it would fault past its end
+    struct stat st_buf;
+    if (st->use_mmap && length != 0 && fstat(f->fd, &st_buf) == 0 &&
+        st_buf.st_size >= length) {
+      f->map = (uint8_t *)mmap(NULL, length, PROT_READ, MAP_SHARED, f->fd, 0);
+      f->map = f->map != MAP_FAILED ? f->map : NULL;
+    }
+    return 0;
+  }
+  if (make_parents(path) != 0) {
+    return 1;
+  }
+  f->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (f->fd < 0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  if (ftruncate(f->fd, length) != 0) {
+    perror("Failed to resize file");
+    return 1;
+  }
+  // reserve the blocks up front so the file does not fragment as pieces
+  // land out of order, not every filesystem can
+  if (length != 0 && fallocate(f->fd, 0, 0, length) != 0 &&
+      errno != EOPNOTSUPP) {
+    perror("Failed to preallocate file");
+    return 1;
+  }
+  if (st->use_mmap && length != 0) {
+    f->map = (uint8_t *)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             f->fd, 0);
+    if (f->map == MAP_FAILED) {
+      f->map = NULL;
+      perror("Failed to map file");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Index of the first file holding the byte at offset, by bisecting the
+// start offsets. Empty files share their start with the next file and are
+// skipped over by the callers.
+int32_t storage_find(storage_t *st, int64_t offset) {
+  int32_t lo = 0, hi = st->nfiles - 1;
+  while (lo < hi) {
+    int32_t mid = lo + (hi - lo + 1) / 2;
+    if (st->files[mid].offset <= offset) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+// Read or write n bytes at a torrent offset, one call per file the range
+// touches.
+int32_t storage_io(storage_t *st, int64_t offset, uint8_t *data, uint32_t n,
+                   bool write) {
+  for (int32_t i = storage_find(st, offset); n > 0; ++i) {
+    storage_file_t *f = &st->files[i];
+    int64_t at = i < st->nfiles ? offset - f->offset : -1;
+    if (at < 0 || (at >= f->length && f->length != 0)) {
+      fprintf(stderr, write ? "Write outside of file\n"
+                            : "Read outside of file\n");
+      return 1;
+    }
+    uint32_t k = f->length - at < n ? f->length - at : n;
+    if (f->fd < 0 && write) {
+      // part of a piece that spills into a file we do not keep
+    } else if (f->fd < 0) {
+      return 1;
+    } else if (f->map != NULL && write) {
+      memcpy(f->map + at, data, k);
+    } else if (f->map != NULL) {
+      memcpy(data, f->map + at, k);
+    }
+    for (uint32_t done = 0; f->fd >= 0 && f->map == NULL && done != k;) {
+      ssize_t r = write ? pwrite(f->fd, data + done, k - done, at + done)
+                        : pread(f->fd, data + done, k - done, at + done);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r <= 0) {
+        perror(write ? "Failed to write piece" : "Failed to read piece");
+        return 1;
+      }
+      done += r;
+    }
+    data += k;
+    offset += k;
+    n -= k;
+  }
+  return 0;
+}
+
+int32_t storage_write(storage_t *st, int64_t offset, uint8_t *data,
+                      uint32_t n) {
+  return storage_io(st, offset, data, n, true);
+}
+
+int32_t storage_read(storage_t *st, int64_t offset, uint8_t *data,
+                     uint32_t n) {
+  return storage_io(st, offset, data, n, false);
+}
+
+// Whether n bytes at a torrent offset are all in files we keep.
+bool storage_has(storage_t *st, int64_t offset, uint32_t n) {
+  for (int32_t i = storage_find(st, offset); n > 0 && i < st->nfiles; ++i) {
+    storage_file_t *f = &st->files[i];
+    int64_t k = f->offset + f->length - offset;
+    if (k <= 0) {
+      continue;
+    }
+    if (f->fd < 0) {
+      return false;
+    }
+    k = k < n ? k : n;
+    offset += k;
+    n -= k;
+  }
+  return n == 0;
+}
+
+// The mapping of n bytes of the torrent's data at offset, or NULL when
+// they are not mapped or span files.
+uint8_t *storage_map(storage_t *st, int64_t offset, uint32_t n) {
+  storage_file_t *f = &st->files[storage_find(st, offset)];
+  int64_t at = offset - f->offset;
+  if (f->map == NULL || at < 0 || at + n > f->length) {
+    return NULL;
+  }
+  return f->map + at;
+}
+
+// Send n bytes of the torrent's data at offset to a socket with sendfile,
+// so they go from the page cache to the socket without passing through
+// user space. Returns how many bytes went out before the socket filled
+// up, or -1 on error.
+int64_t storage_send(storage_t *st, int32_t sockfd, int64_t offset,
+                     uint32_t n) {
+  int64_t sent = 0;
+  while (n > 0) {
+    storage_file_t *f = &st->files[storage_find(st, offset)];
+    int64_t at = offset - f->offset;
+    if (f->fd < 0 || at < 0 || at >= f->length) {
+      fprintf(stderr, "Read outside of file\n");
+      return -1;
+    }
+    off_t pos = at;
+    int64_t k = f->length - at < n ? f->length - at : n;
+    ssize_t r = sendfile(sockfd, f->fd, &pos, k);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return sent;
+    }
+    if (r <= 0) {
+      // a zero return means the file is shorter than it should be
+      return -1;
+    }
+    sent += r;
+    offset += r;
+    n -= r;
+    if (r < k) {
+      return sent;
+    }
+  }
+  return sent;
+}
+
+void storage_close(storage_t *st) {
+  for (int32_t i = 0; i < st->nfiles; ++i) {
+    if (st->files[i].map != NULL) {
+      munmap(st->files[i].map, st->files[i].length);
+    }
+    if (st->files[i].fd >= 0) {
+      close(st->files[i].fd);
+    }
+    free(st->files[i].path);
+  }
+  free(st->files);
+}
+
+// Fast resume state kept beside the output: which pieces have been verified
+// and written, plus the size and mtime each data file had when that was
+// last known to be accurate. The file records are zeroed while a download
+// runs, so after a crash the completed pieces are hashed again before being
+// trusted; after a clean exit they are taken as they are. A skipped file
+// has no record.
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint8_t info_hash[SHA_DIGEST_LENGTH];
+  uint32_t npieces;
+  uint32_t nfiles;
+} resume_header_t;
+
+typedef struct {
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} resume_file_t;
+
+typedef struct {
+  int32_t fd;
+  resume_header_t header;
+  resume_file_t *files;
+  uint8_t *bitmap;
+} resume_t;
+
+const char RESUME_MAGIC[4] = {'B', 'T', 'R', 'S'};
+const uint32_t RESUME_VERSION = 1;
+
+int32_t resume_bitmap_offset(resume_t *rs) {
+  return sizeof(resume_header_t) + rs->header.nfiles * sizeof(resume_file_t);
+}
+
+bool resume_file_matches(resume_file_t *f, char *filename) {
+  struct stat st;
+  if (filename == NULL) {
+    return f->size == 0 && f->mtime_sec == 0 && f->mtime_nsec == 0;
+  }
+  return f->mtime_sec != 0 && stat(filename, &st) == 0 &&
+         st.st_size == f->size && st.st_mtim.tv_sec == f->mtime_sec &&
+         st.st_mtim.tv_nsec == f->mtime_nsec;
+}
+
+// Let go of the resume file without recording the data files, as when
+// setting up a download fails.
+void resume_free(resume_t *rs) {
+  if (rs->fd >= 0) {
+    close(rs->fd);
+  }
+  free(rs->files);
+  free(rs->bitmap);
+}
+
+// Open the resume file for a download and load the pieces it records.
+// *trusted is set when no data file has changed since a clean exit. A NULL
+// entry in datafiles is a skipped file.
+int32_t resume_open(resume_t *rs, char *path, uint8_t *hash,
+                    uint32_t npieces, char **datafiles, uint32_t nfiles,
+                    bool *trusted) {
+  rs->bitmap = (uint8_t *)calloc((npieces + 7) / 8, 1);
+  rs->files = (resume_file_t *)calloc(nfiles, sizeof(resume_file_t));
+  rs->fd = -1;
+  if (rs->bitmap == NULL || rs->files == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    resume_free(rs);
+    return 1;
+  }
+  rs->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (rs->fd < 0) {
+    perror("Failed to open resume file");
+    resume_free(rs);
+    return 1;
+  }
+
+  resume_header_t h;
+  *trusted = false;
+  if (pread(rs->fd, &h, sizeof(h), 0) == sizeof(h) &&
+      memcmp(h.magic, RESUME_MAGIC, 4) == 0 && h.version == RESUME_VERSION &&
+      memcmp(h.info_hash, hash, SHA_DIGEST_LENGTH) == 0 &&
+      h.npieces == npieces && h.nfiles == nfiles) {
+    rs->header = h;
+    ssize_t n = nfiles * sizeof(resume_file_t);
+    if (pread(rs->fd, rs->files, n, sizeof(h)) == n &&
+        pread(rs->fd, rs->bitmap, (npieces + 7) / 8,
+              resume_bitmap_offset(rs)) == (npieces + 7) / 8) {
+      *trusted = true;
+      for (uint32_t i = 0; i < nfiles; ++i) {
+        *trusted &= resume_file_matches(&rs->files[i], datafiles[i]);
+      }
+    } else {
+      memset(rs->bitmap, 0, (npieces + 7) / 8);
+    }
+  }
+
+  memcpy(rs->header.magic, RESUME_MAGIC, 4);
+  rs->header.version = RESUME_VERSION;
+  memcpy(rs->header.info_hash, hash, SHA_DIGEST_LENGTH);
+  rs->header.npieces = npieces;
+  rs->header.nfiles = nfiles;
+  return 0;
+}
+
+// Write out the loaded state with the file record cleared, from here on
+// pieces are recorded one bitmap byte at a time.
+int32_t resume_begin(resume_t *rs) {
+  ssize_t files = rs->header.nfiles * sizeof(resume_file_t);
+  memset(rs->files, 0, files);
+  uint32_t n = (rs->header.npieces + 7) / 8;
+  if (pwrite(rs->fd, &rs->header, sizeof(rs->header), 0) !=
+          sizeof(rs->header) ||
+      pwrite(rs->fd, rs->files, files, sizeof(rs->header)) != files ||
+      pwrite(rs->fd, rs->bitmap, n, resume_bitmap_offset(rs)) != n ||
+      ftruncate(rs->fd, resume_bitmap_offset(rs) + n) != 0) {
+    perror("Failed to write resume file");
+    return 1;
+  }
+  return 0;
+}
+
+int32_t resume_mark(resume_t *rs, uint32_t index) {
+  bitfield_set(rs->bitmap, index);
+  if (pwrite(rs->fd, rs->bitmap + index / 8, 1,
+             resume_bitmap_offset(rs) + index / 8) != 1) {
+    perror("Failed to update resume file");
+    return 1;
+  }
+  return 0;
+}
+
+// Record the data files as they are now. Call once they are no longer
+// written to.
+void resume_close(resume_t *rs, char **datafiles) {
+  struct stat st;
+  for (uint32_t i = 0; i < rs->header.nfiles; ++i) {
+    if (datafiles[i] != NULL && stat(datafiles[i], &st) == 0) {
+      rs->files[i].size = st.st_size;
+      rs->files[i].mtime_sec = st.st_mtim.tv_sec;
+      rs->files[i].mtime_nsec = st.st_mtim.tv_nsec;
+    }
+  }
+  ssize_t n = rs->header.nfiles * sizeof(resume_file_t);
+  if (pwrite(rs->fd, rs->files, n, sizeof(rs->header)) != n) {
+    perror("Failed to write resume file");
+  }
+  resume_free(rs);
+}
+
+// Swarm-wide piece availability. Pieces we still need to start are kept in
+// an array ordered by how many peers have them, with bucket[a] the position
+// of the first one that at least a peers have. Gaining or losing a peer for
+// a piece swaps it across the neighbouring bucket boundary, so updates are
+// O(1) and the rarest candidate a peer has is the first hit of a scan from
+// the front.
+//
+// Pieces of higher priority sort ahead of all lower ones: the key a piece
+// is bucketed by is its count offset by a band of max_count + 1 keys for
+// each priority level below the highest.
+typedef struct {
+  uint16_t *count;  // peers that have each piece
+  uint8_t *prio;    // priority of each piece
+  uint32_t *order;  // candidate pieces, rarest first
+  uint32_t *pos;    // position of each piece in order
+  uint32_t *bucket; // nkeys + 1 entries, the last one ends the array
+  uint32_t ncandidates;
+  uint32_t max_count;
+  uint32_t nkeys;
+} picker_t;
+
+const uint32_t NOT_CANDIDATE = UINT32_MAX;
+// priorities of wanted pieces, a piece of priority 0 is not downloaded
+const uint8_t PRIORITY_NORMAL = 1;
+const uint8_t PRIORITY_HIGH = 2;
+
+int32_t picker_init(picker_t *pk, uint32_t npieces, uint32_t max_count) {
+  pk->nkeys = (max_count + 1) * PRIORITY_HIGH;
+  pk->count = (uint16_t *)calloc(npieces, sizeof(uint16_t));
+  pk->prio = (uint8_t *)malloc(npieces * sizeof(uint8_t));
+  pk->order = (uint32_t *)malloc(npieces * sizeof(uint32_t));
+  pk->pos = (uint32_t *)malloc(npieces * sizeof(uint32_t));
+  pk->bucket = (uint32_t *)calloc(pk->nkeys + 1, sizeof(uint32_t));
+  if (pk->count == NULL || pk->prio == NULL || pk->order == NULL ||
+      pk->pos == NULL || pk->bucket == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  for (uint32_t i = 0; i < npieces; ++i) {
+    pk->pos[i] = NOT_CANDIDATE;
+    pk->prio[i] = PRIORITY_NORMAL;
+  }
+  pk->ncandidates = 0;
+  pk->max_count = max_count;
+  return 0;
+}
+
+void picker_free(picker_t *pk) {
+  free(pk->count);
+  free(pk->prio);
+  free(pk->order);
+  free(pk->pos);
+  free(pk->bucket);
+}
+
+uint32_t picker_key(picker_t *pk, uint32_t index) {
+  return pk->count[index] +
+         (PRIORITY_HIGH - pk->prio[index]) * (pk->max_count + 1);
+}
+
+void picker_swap(picker_t *pk, uint32_t x, uint32_t y) {
+  uint32_t px = pk->order[x], py = pk->order[y];
+  pk->order[x] = py;
+  pk->order[y] = px;
+  pk->pos[py] = x;
+  pk->pos[px] = y;
+}
+
+void picker_insert(picker_t *pk, uint32_t index) {
+  if (pk->pos[index] != NOT_CANDIDATE) {
+    return;
+  }
+  // append, then walk down to the end of its bucket by trading places with
+  // the first piece of every bucket above it
+  uint32_t h = pk->ncandidates++;
+  pk->order[h] = index;
+  pk->pos[index] = h;
+  ++pk->bucket[pk->nkeys];
+  for (uint32_t b = pk->nkeys - 1; b > picker_key(pk, index); --b) {
+    picker_swap(pk, h, pk->bucket[b]);
+    h = pk->bucket[b]++;
+  }
+}
+
+void picker_remove(picker_t *pk, uint32_t index) {
+  if (pk->pos[index] == NOT_CANDIDATE) {
+    return;
+  }
+  // the reverse of insert, bubble it up to the end of the array
+  uint32_t h = pk->pos[index];
+  for (uint32_t b = picker_key(pk, index) + 1; b <= pk->nkeys; ++b) {
+    picker_swap(pk, h, pk->bucket[b] - 1);
+    h = --pk->bucket[b];
+  }
+  --pk->ncandidates;
+  pk->pos[index] = NOT_CANDIDATE;
+}
+
+void picker_inc(picker_t *pk, uint32_t index) {
+  if (pk->count[index] == pk->max_count) {
+    return;
+  }
+  uint32_t a = picker_key(pk, index);
+  if (pk->pos[index] != NOT_CANDIDATE) {
+    picker_swap(pk, pk->pos[index], pk->bucket[a + 1] - 1);
+    --pk->bucket[a + 1];
+  }
+  ++pk->count[index];
+}
+
+void picker_dec(picker_t *pk, uint32_t index) {
+  if (pk->count[index] == 0) {
+    return;
+  }
+  uint32_t a = picker_key(pk, index);
+  if (pk->pos[index] != NOT_CANDIDATE) {
+    picker_swap(pk, pk->pos[index], pk->bucket[a]);
+    ++pk->bucket[a];
+  }
+  --pk->count[index];
+}
+
+// The rarest candidate of the highest priority the peer has, or
+// NOT_CANDIDATE.
+uint32_t picker_pick(picker_t *pk, uint8_t *bitfield) {
+  for (uint32_t k = pk->bucket[1]; k < pk->ncandidates; ++k) {
+    if (bitfield_has(bitfield, pk->order[k])) {
+      return pk->order[k];
+    }
+  }
+  return NOT_CANDIDATE;
+}
+
+// Apply a peer's bitfield to the counts, a byte at a time so that the
+// empty stretches of a partial peer cost next to nothing.
+void picker_apply_bitfield(picker_t *pk, uint8_t *bitfield, uint32_t npieces,
+                           bool add) {
+  for (uint32_t i = 0; i < (npieces + 7) / 8; ++i) {
+    for (uint32_t bits = bitfield[i]; bits != 0; bits &= bits - 1) {
+      uint32_t index = i * 8 + 7 - __builtin_ctz(bits);
+      if (add) {
+        picker_inc(pk, index);
+      } else {
+        picker_dec(pk, index);
+      }
+    }
+  }
+}
+
+typedef enum {
+  PIECE_UNWANTED,
+  PIECE_MISSING,
+  PIECE_ACTIVE,
+  PIECE_DONE
+} piece_state_t;
+
+typedef enum {
+  BLOCK_MISSING,
+  BLOCK_REQUESTED,
+  BLOCK_RECEIVING, // its payload is being read into the piece
+  BLOCK_RECEIVED
+} block_state_t;
+
+// Free piece buffers kept for reuse, one list per power-of-two size class.
+// A free buffer holds the link to the next one in its first bytes, so the
+// pool needs no memory of its own. Only the event loop uses it.
+typedef struct {
+  void *free[32];
+} bufpool_t;
+
+uint32_t bufpool_class(uint32_t size) {
+  uint32_t c = 0;
+  while ((1u << c) < size) {
+    ++c;
+  }
+  return c;
+}
+
+uint8_t *bufpool_get(bufpool_t *pool, uint32_t size) {
+  uint32_t c = bufpool_class(max(size, sizeof(void *)));
+  void *buf = pool->free[c];
+  if (buf == NULL) {
+    return (uint8_t *)malloc((size_t)1 << c);
+  }
+  pool->free[c] = *(void **)buf;
+  return (uint8_t *)buf;
+}
+
+void bufpool_put(bufpool_t *pool, uint8_t *buf, uint32_t size) {
+  uint32_t c = bufpool_class(max(size, sizeof(void *)));
+  *(void **)buf = pool->free[c];
+  pool->free[c] = buf;
+}
+
+void bufpool_free(bufpool_t *pool) {
+  for (uint32_t c = 0; c < 32; ++c) {
+    while (pool->free[c] != NULL) {
+      void *next = *(void **)pool->free[c];
+      free(pool->free[c]);
+      pool->free[c] = next;
+    }
+  }
+}
+
+typedef struct {
+  uint32_t index;
+  uint32_t begin;
+  uint32_t length;
+  int64_t sent_us;
+} request_t;
+
+// A piece that is being downloaded. Its blocks may be requested from
+// several peers.
+typedef struct {
+  uint32_t index;
+  uint32_t size;
+  uint32_t nblocks;
+  uint32_t received;
+  uint32_t cursor; // no block below this one is missing
+  uint8_t *blocks;
+  uint8_t *requesters; // peers with a request out for each block
+  uint8_t *sources;    // slot of the peer each block came from
+  uint32_t *conns;     // and its connection, the slot may be reused since
+  uint8_t *data;
+} piece_t;
+
+// Hands out blocks to peers. A peer first gets the missing blocks of pieces
+// already in progress, then the rarest piece it has is started. Blocks
+// requested from a
+// peer that fails or chokes us go back to missing so any other peer that
+// has the piece picks them up.
+//
+// Once every wanted piece has been started the scheduler enters endgame and
+// blocks that are already requested are handed out again to other peers
+// that have them, so the last pieces are not held up by the slowest peer.
+typedef struct {
+  uint8_t *state;
+  uint32_t npieces;
+  uint32_t wanted;
+  uint32_t done;
+  piece_t **pieces; // in-progress piece by index
+  piece_t **active;
+  uint32_t nactive;
+  picker_t picker;
+  bufpool_t pool; // piece buffers
+  bool endgame;
+} scheduler_t;
+
+// Whether or not it succeeds, sched is to be freed with scheduler_free.
+int32_t scheduler_init(scheduler_t *sched, uint32_t npieces,
+                       uint32_t max_peers) {
+  sched->npieces = npieces;
+  sched->wanted = 0;
+  sched->done = 0;
+  sched->nactive = 0;
+  memset(&sched->pool, 0, sizeof(bufpool_t));
+  sched->endgame = false;
+  sched->state = (uint8_t *)calloc(npieces, sizeof(uint8_t));
+  sched->pieces = (piece_t **)calloc(npieces, sizeof(piece_t *));
+  sched->active = (piece_t **)calloc(npieces, sizeof(piece_t *));
+  int32_t ret = picker_init(&sched->picker, npieces, max_peers);
+  if (sched->state == NULL || sched->pieces == NULL || sched->active == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  return ret;
+}
+
+void scheduler_free(scheduler_t *sched) {
+  for (uint32_t i = 0; i < sched->nactive; ++i) {
+    free(sched->active[i]->blocks);
+    free(sched->active[i]->requesters);
+    free(sched->active[i]->sources);
+    free(sched->active[i]->conns);
+    bufpool_put(&sched->pool, sched->active[i]->data, sched->active[i]->size);
+    free(sched->active[i]);
+  }
+  bufpool_free(&sched->pool);
+  free(sched->active);
+  free(sched->pieces);
+  free(sched->state);
+  picker_free(&sched->picker);
+}
+
+void scheduler_want(scheduler_t *sched, uint32_t index, uint8_t prio) {
+  if (sched->state[index] == PIECE_UNWANTED) {
+    sched->state[index] = PIECE_MISSING;
+    sched->picker.prio[index] = prio;
+    picker_insert(&sched->picker, index);
+    ++sched->wanted;
+  }
+}
+
+// Record a piece as already on disk.
+void scheduler_have(scheduler_t *sched, uint32_t index) {
+  if (sched->state[index] == PIECE_UNWANTED) {
+    ++sched->wanted;
+  } else if (sched->state[index] == PIECE_MISSING) {
+    picker_remove(&sched->picker, index);
+  } else {
+    return;
+  }
+  sched->state[index] = PIECE_DONE;
+  ++sched->done;
+}
+
+piece_t *scheduler_activate(scheduler_t *sched, uint32_t index,
+                            uint32_t size) {
+  piece_t *piece = (piece_t *)malloc(sizeof(piece_t));
+  if (piece == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return NULL;
+  }
+  piece->index = index;
+  piece->size = size;
+  piece->nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  piece->received = 0;
+  piece->cursor = 0;
+  piece->blocks = (uint8_t *)calloc(piece->nblocks, sizeof(uint8_t));
+  piece->requesters = (uint8_t *)calloc(piece->nblocks, sizeof(uint8_t));
+  piece->sources = (uint8_t *)calloc(piece->nblocks, sizeof(uint8_t));
+  piece->conns = (uint32_t *)calloc(piece->nblocks, sizeof(uint32_t));
+  piece->data = bufpool_get(&sched->pool, size);
+  if (piece->blocks == NULL || piece->requesters == NULL ||
+      piece->sources == NULL || piece->conns == NULL || piece->data == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    free(piece->blocks);
+    free(piece->requesters);
+    free(piece->sources);
+    free(piece->conns);
+    if (piece->data != NULL) {
+      bufpool_put(&sched->pool, piece->data, size);
+    }
+    free(piece);
+    return NULL;
+  }
+  sched->state[index] = PIECE_ACTIVE;
+  picker_remove(&sched->picker, index);
+  sched->pieces[index] = piece;
+  sched->active[sched->nactive++] = piece;
+  return piece;
+}
+
+void scheduler_retire(scheduler_t *sched, piece_t *piece, bool ok) {
+  for (uint32_t i = 0; i < sched->nactive; ++i) {
+    if (sched->active[i] == piece) {
+      sched->active[i] = sched->active[--sched->nactive];
+      break;
+    }
+  }
+  sched->pieces[piece->index] = NULL;
+  sched->state[piece->index] = ok ? PIECE_DONE : PIECE_MISSING;
+  sched->done += ok;
+  if (!ok) {
+    picker_insert(&sched->picker, piece->index);
+  }
+  free(piece->blocks);
+  free(piece->requesters);
+  free(piece->sources);
+  free(piece->conns);
+  bufpool_put(&sched->pool, piece->data, piece->size);
+  free(piece);
+}
+
+uint32_t piece_size(uint64_t total_length, uint32_t piece_length,
+                    uint32_t index) {
+  uint64_t offset = (uint64_t)index * piece_length;
+  return total_length - offset < piece_length ? total_length - offset
+                                              : piece_length;
+}
+
+bool list_has(uint32_t *list, uint32_t n, uint32_t x) {
+  for (uint32_t i = 0; i < n; ++i) {
+    if (list[i] == x) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Pick the next block to request from a peer with the given bitfield.
+// Pieces already started come first, then the last of the nprefer pieces
+// in prefer the peer has, then the rarest. With only_prefer set nothing
+// outside prefer is picked. Returns 1 if the peer has nothing we still
+// need.
+int32_t scheduler_pick(scheduler_t *sched, uint8_t *bitfield,
+                       uint64_t total_length, uint32_t piece_length,
+                       uint32_t *prefer, uint32_t nprefer, bool only_prefer,
+                       uint32_t *index, uint32_t *begin, uint32_t *length) {
+  piece_t *piece = NULL;
+  for (uint32_t i = 0; i < sched->nactive && piece == NULL; ++i) {
+    piece_t *p = sched->active[i];
+    while (p->cursor < p->nblocks && p->blocks[p->cursor] != BLOCK_MISSING) {
+      ++p->cursor;
+    }
+    if (p->cursor < p->nblocks && bitfield_has(bitfield, p->index) &&
+        (!only_prefer || list_has(prefer, nprefer, p->index))) {
+      piece = p;
+    }
+  }
+  for (uint32_t i = nprefer; i > 0 && piece == NULL; --i) {
+    uint32_t k = prefer[i - 1];
+    if (sched->state[k] == PIECE_MISSING && bitfield_has(bitfield, k)) {
+      piece = scheduler_activate(sched, k,
+                                 piece_size(total_length, piece_length, k));
+      if (piece == NULL) {
+        return 1;
+      }
+    }
+  }
+  if (piece == NULL) {
+    if (only_prefer) {
+      return 1;
+    }
+    uint32_t i = picker_pick(&sched->picker, bitfield);
+    if (i == NOT_CANDIDATE) {
+      return 1;
+    }
+    piece = scheduler_activate(sched, i,
+                               piece_size(total_length, piece_length, i));
+    if (piece == NULL) {
+      return 1;
+    }
+  }
+
+  uint32_t block = piece->cursor++;
+  piece->blocks[block] = BLOCK_REQUESTED;
+  piece->requesters[block] = 1;
+  *index = piece->index;
+  *begin = block * BLOCK_SIZE;
+  *length = min(piece->size - *begin, BLOCK_SIZE);
+  return 0;
+}
+
+// In endgame, pick the outstanding block with the fewest requesters among
+// those the peer has and has not requested itself. Returns 1 if there is
+// none, or if the scheduler is not in endgame yet.
+int32_t scheduler_pick_endgame(scheduler_t *sched, uint8_t *bitfield,
+                               request_t *requests, uint32_t inflight,
+                               uint32_t *index, uint32_t *begin,
+                               uint32_t *length) {
+  if (sched->picker.ncandidates != 0) {
+    return 1;
+  }
+  sched->endgame = true;
+
+  piece_t *best = NULL;
+  uint32_t best_block = 0;
+  for (uint32_t i = 0; i < sched->nactive; ++i) {
+    piece_t *p = sched->active[i];
+    if (!bitfield_has(bitfield, p->index)) {
+      continue;
+    }
+    for (uint32_t b = 0; b < p->nblocks; ++b) {
+      if (p->blocks[b] != BLOCK_REQUESTED || p->requesters[b] == UINT8_MAX ||
+          (best != NULL &&
+           p->requesters[b] >= best->requesters[best_block])) {
+        continue;
+      }
+      uint32_t k = 0;
+      while (k < inflight && (requests[k].index != p->index ||
+                              requests[k].begin != b * BLOCK_SIZE)) {
+        ++k;
+      }
+      if (k == inflight) {
+        best = p;
+        best_block = b;
+      }
+    }
+  }
+  if (best == NULL) {
+    return 1;
+  }
+
+  ++best->requesters[best_block];
+  *index = best->index;
+  *begin = best_block * BLOCK_SIZE;
+  *length = min(best->size - *begin, BLOCK_SIZE);
+  return 0;
+}
+
+void scheduler_unrequest(scheduler_t *sched, uint32_t index, uint32_t begin) {
+  piece_t *piece = sched->pieces[index];
+  uint32_t block = begin / BLOCK_SIZE;
+  if (piece != NULL && piece->blocks[block] == BLOCK_REQUESTED &&
+      --piece->requesters[block] == 0) {
+    piece->blocks[block] = BLOCK_MISSING;
+    piece->cursor = min(piece->cursor, block);
+  }
+}
+
+typedef struct {
+  piece_t *piece;
+  uint8_t *hash; // expected digest
+  int64_t offset;
+  bool verified;
+  bool written;
+} hash_job_t;
+
+// Worker threads that verify completed pieces and write them to storage,
+// so the event loop keeps reading from peers meanwhile. Finished jobs are
+// queued back and the loop is woken through an eventfd. At most cap jobs
+// are in the pool at once, which bounds both queues.
+typedef struct {
+  pthread_t *threads;
+  int32_t nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  hash_job_t *jobs;
+  uint32_t jobs_head;
+  uint32_t jobs_len;
+  hash_job_t *done;
+  uint32_t done_head;
+  uint32_t done_len;
+  uint32_t cap;
+  uint32_t pending; // submitted and not yet collected
+  uint32_t writing; // jobs in storage_write, updated atomically
+  bool stop;
+  int32_t efd;
+  storage_t *storage;
+} hasher_t;
+
+void *hasher_worker(void *arg) {
+  hasher_t *h = (hasher_t *)arg;
+  for (;;) {
+    pthread_mutex_lock(&h->lock);
+    while (h->jobs_len == 0 && !h->stop) {
+      pthread_cond_wait(&h->cond, &h->lock);
+    }
+    if (h->jobs_len == 0) {
+      pthread_mutex_unlock(&h->lock);
+      return NULL;
+    }
+    hash_job_t job = h->jobs[h->jobs_head];
+    h->jobs_head = (h->jobs_head + 1) % h->cap;
+    --h->jobs_len;
+    pthread_mutex_unlock(&h->lock);
+
+    piece_t *piece = job.piece;
+    job.verified = verify_piece(piece->data, piece->size, job.hash) == 0;
+    if (job.verified) {
+      __atomic_add_fetch(&h->writing, 1, __ATOMIC_RELAXED);
+      job.written =
+          storage_write(h->storage, job.offset, piece->data, piece->size) == 0;
+      __atomic_sub_fetch(&h->writing, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&h->lock);
+    h->done[(h->done_head + h->done_len++) % h->cap] = job;
+    pthread_mutex_unlock(&h->lock);
+    uint64_t one = 1;
+    if (write(h->efd, &one, sizeof(one)) != sizeof(one)) {
+      perror("Failed to signal hash completion");
+    }
+  }
+}
+
+// Start the pool. Whether or not it succeeds, h is to be freed with
+// hasher_free.
+int32_t hasher_init(hasher_t *h, storage_t *storage, uint32_t cap) {
+  h->jobs_head = h->jobs_len = 0;
+  h->done_head = h->done_len = 0;
+  h->cap = cap;
+  h->pending = 0;
+  h->writing = 0;
+  h->stop = false;
+  h->storage = storage;
+  h->nthreads = 0;
+  pthread_mutex_init(&h->lock, NULL);
+  pthread_cond_init(&h->cond, NULL);
+  int32_t nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  nthreads = nthreads < 1 ? 1 : min(nthreads, MAX_HASH_THREADS);
+  h->threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+  h->jobs = (hash_job_t *)malloc(cap * sizeof(hash_job_t));
+  h->done = (hash_job_t *)malloc(cap * sizeof(hash_job_t));
+  if ((h->efd = eventfd(0, EFD_NONBLOCK)) < 0) {
+    perror("Failed to create eventfd");
+    return 1;
+  }
+  if (h->threads == NULL || h->jobs == NULL || h->done == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  for (; h->nthreads < nthreads; ++h->nthreads) {
+    if (pthread_create(&h->threads[h->nthreads], NULL, hasher_worker, h) !=
+        0) {
+      fprintf(stderr, "Failed to start hash thread\n");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Queue a piece for verification. Returns 1 if the pool is full.
+int32_t hasher_submit(hasher_t *h, hash_job_t *job) {
+  if (h->pending == h->cap) {
+    return 1;
+  }
+  pthread_mutex_lock(&h->lock);
+  h->jobs[(h->jobs_head + h->jobs_len++) % h->cap] = *job;
+  pthread_cond_signal(&h->cond);
+  pthread_mutex_unlock(&h->lock);
+  ++h->pending;
+  return 0;
+}
+
+// Take up to max finished jobs off the completion queue.
+uint32_t hasher_collect(hasher_t *h, hash_job_t *out, uint32_t max) {
+  uint64_t count;
+  if (read(h->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    perror("Failed to read eventfd");
+  }
+  pthread_mutex_lock(&h->lock);
+  uint32_t n = 0;
+  for (; n < max && h->done_len != 0; ++n) {
+    out[n] = h->done[h->done_head];
+    h->done_head = (h->done_head + 1) % h->cap;
+    --h->done_len;
+  }
+  pthread_mutex_unlock(&h->lock);
+  h->pending -= n;
+  return n;
+}
+
+// Let the workers finish the queued jobs and exit. Their results can still
+// be collected afterwards.
+void hasher_stop(hasher_t *h) {
+  pthread_mutex_lock(&h->lock);
+  h->stop = true;
+  pthread_cond_broadcast(&h->cond);
+  pthread_mutex_unlock(&h->lock);
+  for (int32_t i = 0; i < h->nthreads; ++i) {
+    pthread_join(h->threads[i], NULL);
+  }
+  h->nthreads = 0;
+}
+
+void hasher_free(hasher_t *h) {
+  hasher_stop(h);
+  pthread_mutex_destroy(&h->lock);
+  pthread_cond_destroy(&h->cond);
+  if (h->efd >= 0) {
+    close(h->efd);
+  }
+  free(h->threads);
+  free(h->jobs);
+  free(h->done);
+}
+
+typedef enum {
+  PEER_CONNECTING, // non-blocking connect in progress
+  PEER_HANDSHAKE,  // handshake sent, waiting for the peer's
+  PEER_BITFIELD,   // waiting for the first message, normally a bitfield
+  PEER_CHOKED,     // interested, waiting to be unchoked
+  PEER_ACTIVE,     // unchoked, requesting blocks
+  PEER_CLOSED,
+} peer_state_t;
+
+// Counters kept per connection for the metrics export. They are plain
+// increments on paths that already touch the peer.
+typedef struct {
+  uint64_t bytes_in;  // everything read from the socket
+  uint64_t bytes_out; // everything written to it
+  uint32_t blocks;
+  uint32_t hash_failures; // failed pieces this peer sent blocks of
+  int64_t choked_us;      // time spent choked after saying we are interested
+  int64_t choked_since_us;
+  uint32_t rtt[12]; // block round trips up to 1, 2, 4, ... 1024 ms, more
+} peer_stats_t;
+
+typedef struct {
+  int32_t fd;
+  peer_state_t state;
+  uint8_t info[6]; // compact ip:port
+  bool incoming;
+  int32_t candidate; // where we dialed it from, -1 if it dialed us
+  bool greeted;      // our handshake and bitfield are out
+  bool fast;         // both sides speak the Fast Extension
+  bool extended;     // and the extension protocol (BEP 10)
+  // its id for ut_metadata messages, 0 if it has none
+  uint8_t ut_metadata;
+  uint32_t conn; // numbers the connections the slot has held
+  int64_t connected_us;
+  int64_t deadline_us;
+  int64_t written_us; // when anything last went out to it
+  uint8_t *bitfield;
+
+  // bytes received and not decoded yet, and the payload of a wanted block
+  // that goes straight to its place in the piece as it arrives
+  uint8_t *in;
+  uint32_t in_len;
+  uint8_t block[9]; // that block's message up to the payload
+  uint32_t msg_len;
+  uint8_t *body;
+  uint32_t body_len; // of the payload in place
+
+  // bytes waiting for the socket to become writable, all of them sent
+  // together once the current round of events is handled
+  uint8_t *out;
+  uint32_t out_len;
+  uint32_t out_cap;
+  bool want_write;
+  bool dirty; // something to flush this round
+
+  // blocks the peer asked us for. The payload of the first one follows
+  // the first payload_at bytes of out once its header is queued.
+  bool peer_interested;
+  bool peer_choked; // by us
+  bool unchoke;     // choker's pick for this round
+  request_t *uploads;
+  uint32_t uploads_head;
+  uint32_t nuploads;
+  bool upload_started;
+  uint32_t payload_at;
+  uint32_t upload_sent;
+  uint32_t granted[10]; // pieces it may fetch while choked
+  uint32_t ngranted;
+
+  // pieces the peer lets us fetch while it chokes us, and the ones it
+  // suggests we take, newest last
+  uint32_t allowed[32];
+  uint32_t nallowed;
+  uint32_t suggested[8];
+  uint32_t nsuggested;
+
+  pipeline_t pl;
+  request_t *requests;
+  uint32_t inflight;
+  bool snubbed; // held to one request until it delivers again
+  int64_t last_block_us;
+  peer_stats_t stats;
+
+  // transfer rates over the last choke round, bytes per second
+  uint64_t round_in;
+  uint64_t round_out;
+  double down_rate;
+  double up_rate;
+} peer_t;
+
+// Periodic export of the counters as one JSON object per line.
+typedef struct {
+  FILE *out; // NULL when disabled
+  int64_t start_us;
+  int64_t next_us;
+  int64_t last_us;
+  uint64_t last_downloaded;
+} metrics_t;
+
+// A peer the tracker named, dialed while there are free slots.
+typedef struct {
+  uint8_t info[6];
+  int32_t slot; // its connection, -1 when not connected
+  uint8_t fails;
+  int64_t retry_us;
+} candidate_t;
+
+typedef struct {
+  scheduler_t sched;
+  storage_t storage;
+  resume_t *resume;
+  hasher_t hasher;
+  uint8_t *hashes;
+  uint64_t total_length;
+  uint32_t piece_length;
+  uint8_t info_hash[SHA_DIGEST_LENGTH];
+  uint8_t peer_id[20];
+  char *info; // the bencoded info dict, for peers that fetch it (BEP 9)
+  int64_t info_len;
+
+  int32_t epfd;
+  int32_t listen_fd;
+  uint16_t port; // 0 to not accept peers
+  bool seeding;  // keep serving until interrupted
+  bool nagle;    // leave Nagle's algorithm on for peer connections
+  bool zerocopy; // send mapped block payloads with MSG_ZEROCOPY
+  peer_t *peers;
+  int32_t npeers;
+  int32_t live;
+  uint32_t max_message;
+  uint32_t in_cap; // of a peer's receive buffer
+  uint64_t dup_bytes;  // blocks received more than once
+  uint64_t downloaded; // block payload accepted
+  uint64_t uploaded;
+  uint32_t hash_failures;
+  uint32_t connections; // ever opened, the last one's number
+  metrics_t metrics;
+  bool refill;     // blocks went back to the scheduler, top up every peer
+  bool slot_freed; // an unchoked peer left or lost interest
+
+  int64_t choke_due_us;
+  int64_t choke_last_us;
+  uint32_t choke_round;
+  int32_t optimistic; // slot of the optimistic unchoke, or -1
+
+  // compact ip:port of peers to dial before any tracker has answered
+  uint8_t *known;
+  int32_t nknown;
+  candidate_t *candidates;
+  uint32_t ncandidates;
+  uint32_t next_candidate; // where the next dial looks first
+  int32_t dialing;
+  int64_t dial_due_us; // when a candidate may be dialed again
+  int64_t first_unchoke_us;
+} swarm_t;
+
+// Schedule the next attempt at a candidate, RETRY_DELAY doubled for each
+// failure in a row. After MAX_FAILS of them it is never dialed again.
+void candidate_retry(swarm_t *sw, candidate_t *c, bool failed) {
+  c->fails = failed ? c->fails + 1 : 0;
+  c->retry_us =
+      c->fails >= MAX_FAILS
+          ? INT64_MAX
+          : now_us() + (RETRY_DELAY * 1000000LL << (max(c->fails, 1) - 1));
+  sw->dial_due_us = min64(sw->dial_due_us, c->retry_us);
+}
+
+// Past the handshake and still open.
+bool peer_connected(peer_t *p) {
+  return p->state != PEER_CLOSED && p->state != PEER_CONNECTING &&
+         p->state != PEER_HANDSHAKE;
+}
+
+void peer_close(swarm_t *sw, peer_t *p) {
+  if (p->state == PEER_CLOSED) {
+    return;
+  }
+  if (p->body != NULL) {
+    // give up the block it was in the middle of receiving
+    uint32_t index = ntohl(*(uint32_t *)(p->block + 1));
+    uint32_t begin = ntohl(*(uint32_t *)(p->block + 5));
+    sw->sched.pieces[index]->blocks[begin / BLOCK_SIZE] = BLOCK_REQUESTED;
+    p->body = NULL;
+  }
+  for (uint32_t i = 0; i < p->inflight; ++i) {
+    scheduler_unrequest(&sw->sched, p->requests[i].index,
+                        p->requests[i].begin);
+  }
+  p->inflight = 0;
+  picker_apply_bitfield(&sw->sched.picker, p->bitfield, sw->sched.npieces,
+                        false);
+  sw->slot_freed |= !p->peer_choked;
+  sw->dialing -= p->state == PEER_CONNECTING;
+  if (p->candidate >= 0) {
+    // a connection that never got through the handshake counts as a
+    // failure
+    sw->candidates[p->candidate].slot = -1;
+    candidate_retry(sw, &sw->candidates[p->candidate], !peer_connected(p));
+  }
+  epoll_ctl(sw->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+  close(p->fd);
+  p->state = PEER_CLOSED;
+  --sw->live;
+}
+
+int32_t peer_update_events(swarm_t *sw, peer_t *p) {
+  bool want_write =
+      p->state == PEER_CONNECTING || p->out_len != 0 || p->nuploads != 0;
+  if (want_write == p->want_write) {
+    return 0;
+  }
+  struct epoll_event ev = {.events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+                           .data.ptr = p};
+  p->want_write = want_write;
+  return epoll_ctl(sw->epfd, EPOLL_CTL_MOD, p->fd, &ev) == 0 ? 0 : 1;
+}
+
+// Append n bytes to the output buffer for the caller to fill in. Returns
+// where they start, or NULL if the buffer could not grow.
+uint8_t *peer_out_reserve(peer_t *p, uint32_t n) {
+  if (p->out_len + n > p->out_cap) {
+    uint32_t new_cap = max(2 * p->out_cap, p->out_len + n);
+    uint8_t *new_out = (uint8_t *)realloc(p->out, new_cap);
+    if (new_out == NULL) {
+      fprintf(stderr, "Failed to reallocate memory\n");
+      return NULL;
+    }
+    p->out = new_out;
+    p->out_cap = new_cap;
+  }
+  uint8_t *at = p->out + p->out_len;
+  p->out_len += n;
+  p->dirty = true;
+  return at;
+}
+
+int32_t peer_send(peer_t *p, uint8_t *msg, uint32_t n) {
+  uint8_t *at = peer_out_reserve(p, n);
+  if (at == NULL) {
+    return 1;
+  }
+  memcpy(at, msg, n);
+  return 0;
+}
+
+// Send the first n bytes of the output buffer followed by up to len bytes
+// of payload, both in one call. Returns how much of the payload went out,
+// or -1 on error, and leaves what did not fit for the next time the
+// socket is writable. With MSG_ZEROCOPY only the payload is pinned, the
+// output buffer changes before the pages leave and goes out first.
+int64_t peer_send_out(peer_t *p, uint32_t n, uint8_t *payload, uint32_t len,
+                      int32_t flags) {
+  uint32_t off = 0;
+  uint32_t sent = 0;
+  while (off != n || sent != len) {
+    struct iovec iov[2];
+    int32_t niov = 0;
+    int32_t f = flags;
+    if (off != n) {
+      iov[niov++] = (struct iovec){p->out + off, n - off};
+    }
+    if (off != n && (flags & MSG_ZEROCOPY)) {
+      f = (flags & ~MSG_ZEROCOPY) | MSG_MORE;
+    } else if (sent != len) {
+      iov[niov++] = (struct iovec){payload + sent, len - sent};
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = niov};
+    ssize_t k = sendmsg(p->fd, &msg, MSG_NOSIGNAL | f);
+    if (k < 0 && errno == ENOBUFS && (f & MSG_ZEROCOPY)) {
+      // out of memory to pin pages with, copy instead
+      flags &= ~MSG_ZEROCOPY;
+      continue;
+    }
+    if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (k <= 0) {
+      return -1;
+    }
+    uint32_t from_out = min(k, n - off);
+    off += from_out;
+    sent += k - from_out;
+  }
+  if (off != 0) {
+    p->stats.bytes_out += off;
+    memmove(p->out, p->out + off, p->out_len - off);
+    p->out_len -= off;
+    p->payload_at -= p->upload_started ? off : 0;
+  }
+  return sent;
+}
+
+// Hold back partial segments while several blocks go out, or let them go.
+void peer_cork(peer_t *p, bool cork) {
+  int32_t on = cork;
+  setsockopt(p->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// Write out queued messages. The blocks a peer asked for are sent as a
+// header from the output buffer followed by the payload, in the same call
+// from the storage's mapping when there is one, otherwise straight from
+// the page cache with sendfile. The socket is corked while more than one
+// block is queued, so they go out in full segments.
+int32_t peer_flush(swarm_t *sw, peer_t *p) {
+  uint64_t bytes_out = p->stats.bytes_out;
+  bool corked = p->nuploads > 1;
+  if (corked) {
+    peer_cork(p, true);
+  }
+  int32_t ret = 0;
+  for (;;) {
+    request_t *u = &p->uploads[p->uploads_head];
+    if (p->nuploads != 0 && !p->upload_started) {
+      uint8_t msg[13];
+      *(uint32_t *)msg = htonl(9 + u->length);
+      msg[4] = 7;
+      *(uint32_t *)(msg + 5) = htonl(u->index);
+      *(uint32_t *)(msg + 9) = htonl(u->begin);
+      if (peer_send(p, msg, 13) != 0) {
+        ret = 1;
+        break;
+      }
+      p->upload_started = true;
+      p->payload_at = p->out_len;
+      p->upload_sent = 0;
+    }
+    if (!p->upload_started) {
+      ret = peer_send_out(p, p->out_len, NULL, 0, 0) < 0;
+      break;
+    }
+
+    int64_t offset = (int64_t)u->index * sw->piece_length + u->begin;
+    uint8_t *data = storage_map(&sw->storage, offset, u->length);
+    uint32_t left = u->length - p->upload_sent;
+    int64_t k;
+    if (data != NULL) {
+      int32_t flags = p->nuploads > 1 ? MSG_MORE : 0;
+      flags |= sw->zerocopy && left >= ZEROCOPY_MIN ? MSG_ZEROCOPY : 0;
+      k = peer_send_out(p, p->payload_at, data + p->upload_sent, left, flags);
+    } else {
+      k = peer_send_out(p, p->payload_at, NULL, 0, MSG_MORE);
+      if (k == 0 && p->payload_at == 0) {
+        k = storage_send(&sw->storage, p->fd, offset + p->upload_sent, left);
+      }
+    }
+    if (k < 0) {
+      ret = 1;
+      break;
+    }
+    p->upload_sent += k;
+    p->stats.bytes_out += k;
+    sw->uploaded += k;
+    if (p->upload_sent != u->length) {
+      break;
+    }
+    p->uploads_head = (p->uploads_head + 1) % MAX_UPLOAD_QUEUE;
+    --p->nuploads;
+    p->upload_started = false;
+  }
+  if (corked) {
+    peer_cork(p, false);
+  }
+  if (p->stats.bytes_out != bytes_out) {
+    p->written_us = now_us();
+  }
+  p->dirty = false;
+  return ret != 0 ? 1 : peer_update_events(sw, p);
+}
+
+int32_t peer_send_simple(peer_t *p, uint8_t id) {
+  uint8_t msg[5];
+  *(uint32_t *)msg = htonl(1);
+  msg[4] = id;
+  return peer_send(p, msg, 5);
+}
+
+// Send a reject for a request we will not serve.
+int32_t peer_send_reject(peer_t *p, request_t *u) {
+  uint8_t msg[17];
+  *(uint32_t *)msg = htonl(13);
+  msg[4] = 0x10;
+  *(uint32_t *)(msg + 5) = htonl(u->index);
+  *(uint32_t *)(msg + 9) = htonl(u->begin);
+  *(uint32_t *)(msg + 13) = htonl(u->length);
+  return peer_send(p, msg, 17);
+}
+
+// Top up the peer's request queue to its current pipeline depth. While it
+// chokes us only the pieces it allowed us are asked for, once it unchokes
+// us the ones it suggested go first.
+int32_t peer_fill_requests(swarm_t *sw, peer_t *p) {
+  bool allowed = p->state == PEER_CHOKED && p->nallowed != 0;
+  if (p->state != PEER_ACTIVE && !allowed) {
+    return 0;
+  }
+  uint32_t *prefer = allowed ? p->allowed : p->suggested;
+  uint32_t nprefer = allowed ? p->nallowed : p->nsuggested;
+  if (p->inflight == 0) {
+    // the link was idle, do not count that against the rate or the peer
+    p->pl.window_start_us = now_us();
+    p->pl.window_bytes = 0;
+    p->last_block_us = p->pl.window_start_us;
+  }
+  while (p->inflight < (p->snubbed ? 1 : p->pl.depth)) {
+    request_t *r = &p->requests[p->inflight];
+    if (scheduler_pick(&sw->sched, p->bitfield, sw->total_length,
+                       sw->piece_length, prefer, nprefer, allowed, &r->index,
+                       &r->begin, &r->length) != 0 &&
+        (allowed ||
+         scheduler_pick_endgame(&sw->sched, p->bitfield, p->requests,
+                                p->inflight, &r->index, &r->begin,
+                                &r->length) != 0)) {
+      break;
+    }
+    uint8_t msg[17];
+    *(uint32_t *)msg = htonl(13);
+    msg[4] = 6;
+    *(uint32_t *)(msg + 5) = htonl(r->index);
+    *(uint32_t *)(msg + 9) = htonl(r->begin);
+    *(uint32_t *)(msg + 13) = htonl(r->length);
+    r->sent_us = now_us();
+    ++p->inflight;
+    if (peer_send(p, msg, 17) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Whether we can serve a piece: verified, and not partly in a skipped file.
+bool swarm_can_serve(swarm_t *sw, uint32_t index) {
+  return sw->sched.state[index] == PIECE_DONE &&
+         storage_has(&sw->storage, (int64_t)index * sw->piece_length,
+                     piece_size(sw->total_length, sw->piece_length, index));
+}
+
+// Tell every connected peer that lacks it that we have a new piece.
+void swarm_announce_piece(swarm_t *sw, uint32_t index) {
+  if (!storage_has(&sw->storage, (int64_t)index * sw->piece_length,
+                   piece_size(sw->total_length, sw->piece_length, index))) {
+    return;
+  }
+  uint8_t msg[9];
+  *(uint32_t *)msg = htonl(5);
+  msg[4] = 4;
+  *(uint32_t *)(msg + 5) = htonl(index);
+  for (int32_t i = 0; i < sw->npeers; ++i) {
+    peer_t *p = &sw->peers[i];
+    if (!p->greeted || p->state == PEER_CLOSED ||
+        bitfield_has(p->bitfield, index)) {
+      continue;
+    }
+    if (peer_send(p, msg, 9) != 0) {
+      peer_close(sw, p);
+    }
+  }
+}
+
+// Send what we have after our handshake. A peer known to speak the Fast
+// Extension is told have all or have none when that says it, the others
+// get a bitfield, and must get something since they may speak it too.
+int32_t peer_send_bitfield(swarm_t *sw, peer_t *p) {
+  // built in place, a bitfield can be too big for the stack
+  uint32_t n = (sw->sched.npieces + 7) / 8;
+  uint8_t *msg = peer_out_reserve(p, 5 + n);
+  if (msg == NULL) {
+    return 1;
+  }
+  memset(msg, 0, 5 + n);
+  *(uint32_t *)msg = htonl(1 + n);
+  msg[4] = 5;
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < sw->sched.npieces; ++i) {
+    if (swarm_can_serve(sw, i)) {
+      bitfield_set(msg + 5, i);
+      ++count;
+    }
+  }
+  if (p->fast && (count == 0 || count == sw->sched.npieces)) {
+    p->out_len -= 5 + n;
+    return peer_send_simple(p, count == 0 ? 0x0F : 0x0E);
+  }
+  return 0;
+}
+
+// Grant a peer speaking the Fast Extension the pieces it may fetch from us
+// while choked. The set is the canonical one of BEP 6 for its address, so
+// a new peer gets the same pieces from all of us and can finish them. Only
+// those we have are announced, we may get the rest later.
+int32_t peer_send_allowed_fast(swarm_t *sw, peer_t *p) {
+  uint32_t npieces = sw->sched.npieces;
+  if (!p->fast || npieces <= ALLOWED_FAST_SET) {
+    return 0;
+  }
+  uint8_t x[4 + SHA_DIGEST_LENGTH];
+  memcpy(x, p->info, 3);
+  x[3] = 0;
+  memcpy(x + 4, sw->info_hash, SHA_DIGEST_LENGTH);
+  uint32_t len = sizeof(x);
+  while (p->ngranted < ALLOWED_FAST_SET) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(x, len, digest);
+    memcpy(x, digest, SHA_DIGEST_LENGTH);
+    len = SHA_DIGEST_LENGTH;
+    for (uint32_t i = 0; i < 5 && p->ngranted < ALLOWED_FAST_SET; ++i) {
+      uint32_t index = ntohl(*(uint32_t *)(x + 4 * i)) % npieces;
+      if (!list_has(p->granted, p->ngranted, index)) {
+        p->granted[p->ngranted++] = index;
+      }
+    }
+  }
+
+  uint8_t msg[9];
+  *(uint32_t *)msg = htonl(5);
+  msg[4] = 0x11;
+  for (uint32_t i = 0; i < p->ngranted; ++i) {
+    *(uint32_t *)(msg + 5) = htonl(p->granted[i]);
+    if (swarm_can_serve(sw, p->granted[i]) && peer_send(p, msg, 9) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Our side of the opening: handshake, bitfield and, while downloading,
+// interest, queued together to go out in one write. The peer can unchoke
+// us as soon as it has read them.
+int32_t peer_send_greeting(swarm_t *sw, peer_t *p) {
+  uint8_t msg[68];
+  build_handshake(msg, sw->info_hash, sw->peer_id);
+  if (peer_send(p, msg, 68) != 0 || peer_send_bitfield(sw, p) != 0 ||
+      (sw->sched.done != sw->sched.wanted && peer_send_simple(p, 2) != 0)) {
+    return 1;
+  }
+  p->greeted = true;
+  return 0;
+}
+
+// Our extension handshake, offering our info dict to peers that lack it.
+int32_t peer_send_extended_handshake(swarm_t *sw, peer_t *p) {
+  uint8_t msg[64];
+  return p->extended
+             ? peer_send(p, msg, build_extended_handshake(msg, sw->info_len))
+             : 0;
+}
+
+// Queue a block the peer asked for. Requests for pieces we cannot serve,
+// or made while the peer is choked and not for a piece granted to it, are
+// rejected under the Fast Extension and ignored otherwise. So is one past
+// a full queue, a peer without the extension has no business sending it.
+int32_t peer_on_request(swarm_t *sw, peer_t *p, uint8_t *msg, uint32_t n) {
+  if (n != 13) {
+    return 1;
+  }
+  request_t u = {
+      .index = ntohl(*(uint32_t *)(msg + 1)),
+      .begin = ntohl(*(uint32_t *)(msg + 5)),
+      .length = ntohl(*(uint32_t *)(msg + 9)),
+  };
+  if ((p->peer_choked && !list_has(p->granted, p->ngranted, u.index)) ||
+      u.index >= sw->sched.npieces || u.length == 0 ||
+      u.length > MAX_REQUEST_LENGTH || !swarm_can_serve(sw, u.index) ||
+      (int64_t)u.begin + u.length >
+          piece_size(sw->total_length, sw->piece_length, u.index)) {
+    return p->fast ? peer_send_reject(p, &u) : 0;
+  }
+  if (p->nuploads == MAX_UPLOAD_QUEUE) {
+    return p->fast ? peer_send_reject(p, &u) : 1;
+  }
+  p->uploads[(p->uploads_head + p->nuploads++) % MAX_UPLOAD_QUEUE] = u;
+  return 0;
+}
+
+// Drop a queued block the peer no longer wants, unless it is already on
+// its way. Under the Fast Extension every request gets an answer, this
+// one a reject.
+int32_t peer_on_cancel(peer_t *p, uint8_t *msg, uint32_t n) {
+  if (n != 13) {
+    return 1;
+  }
+  uint32_t index = ntohl(*(uint32_t *)(msg + 1));
+  uint32_t begin = ntohl(*(uint32_t *)(msg + 5));
+  for (uint32_t i = p->upload_started; i < p->nuploads; ++i) {
+    request_t *u = &p->uploads[(p->uploads_head + i) % MAX_UPLOAD_QUEUE];
+    if (u->index == index && u->begin == begin) {
+      if (p->fast && peer_send_reject(p, u) != 0) {
+        return 1;
+      }
+      // keep the order of the rest
+      for (uint32_t k = i; k + 1 < p->nuploads; ++k) {
+        p->uploads[(p->uploads_head + k) % MAX_UPLOAD_QUEUE] =
+            p->uploads[(p->uploads_head + k + 1) % MAX_UPLOAD_QUEUE];
+      }
+      --p->nuploads;
+      return 0;
+    }
+  }
+  return 0;
+}
+
+// Hand the blocks requested from a peer to the others. With keep_allowed
+// set, requests for pieces it allowed us while choked stand.
+void peer_unrequest(swarm_t *sw, peer_t *p, bool keep_allowed) {
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < p->inflight; ++i) {
+    request_t *r = &p->requests[i];
+    if (keep_allowed && list_has(p->allowed, p->nallowed, r->index)) {
+      p->requests[kept++] = *r;
+    } else {
+      scheduler_unrequest(&sw->sched, r->index, r->begin);
+    }
+  }
+  p->inflight = kept;
+  sw->refill = true;
+}
+
+// Peers we let download from us.
+int32_t swarm_unchoked(swarm_t *sw) {
+  int32_t n = 0;
+  for (int32_t i = 0; i < sw->npeers; ++i) {
+    n += sw->peers[i].state != PEER_CLOSED && !sw->peers[i].peer_choked;
+  }
+  return n;
+}
+
+// Choke or unchoke a peer. A choked peer's queued requests are dropped,
+// only the block already on its way is finished. Under the Fast Extension
+// requests for pieces granted to it are kept and the others rejected.
+int32_t peer_set_choked(peer_t *p, bool choked) {
+  if (p->peer_choked == choked) {
+    return 0;
+  }
+  p->peer_choked = choked;
+  if (peer_send_simple(p, choked ? 0 : 1) != 0) {
+    return 1;
+  }
+  if (!choked) {
+    return 0;
+  }
+  uint32_t kept = p->upload_started ? 1 : 0;
+  for (uint32_t i = kept; i < p->nuploads && p->fast; ++i) {
+    request_t *u = &p->uploads[(p->uploads_head + i) % MAX_UPLOAD_QUEUE];
+    if (list_has(p->granted, p->ngranted, u->index)) {
+      p->uploads[(p->uploads_head + kept++) % MAX_UPLOAD_QUEUE] = *u;
+    } else if (peer_send_reject(p, u) != 0) {
+      return 1;
+    }
+  }
+  p->nuploads = kept;
+  return 0;
+}
+
+// Hand slots freed since the last choke round to interested peers, so they
+// do not wait for the next round.
+void swarm_fill_slots(swarm_t *sw) {
+  int32_t free_slots = UNCHOKE_SLOTS - swarm_unchoked(sw);
+  for (int32_t i = 0; free_slots > 0 && i < sw->npeers; ++i) {
+    peer_t *p = &sw->peers[i];
+    if (!peer_connected(p) || !p->peer_interested || !p->peer_choked) {
+      continue;
+    }
+    if (peer_set_choked(p, false) != 0) {
+      peer_close(sw, p);
+      sw->refill = true;
+      continue;
+    }
+    --free_slots;
+  }
+}
+
+// A verified piece is done, one that failed the check goes back to the
+// picker to be downloaded again.
+int32_t swarm_piece_checked(swarm_t *sw, hash_job_t *job) {
+  piece_t *piece = job->piece;
+  if (!job->verified) {
+    fprintf(stderr, "Piece %d failed hash check\n", piece->index);
+    ++sw->hash_failures;
+    // blame every peer that sent part of it, once each, unless its slot
+    // has been taken by another since
+    for (uint32_t i = 0; i < piece->nblocks; ++i) {
+      uint32_t k = 0;
+      while (k < i && piece->conns[k] != piece->conns[i]) {
+        ++k;
+      }
+      peer_t *p = &sw->peers[piece->sources[i]];
+      if (k == i && p->conn == piece->conns[i]) {
+        ++p->stats.hash_failures;
+      }
+    }
+  } else if (!job->written) {
+    return 1;
+  } else {
+    if (sw->resume != NULL) {
+      resume_mark(sw->resume, piece->index);
+    }
+    swarm_announce_piece(sw, piece->index);
+  }
+  scheduler_retire(&sw->sched, piece, job->verified);
+  return 0;
+}
+
+// Hand a complete piece to the hash workers, or check it right here when
+// they are all backed up.
+int32_t swarm_piece_done(swarm_t *sw, piece_t *piece) {
+  hash_job_t job = {
+      .piece = piece,
+      .hash = sw->hashes + piece->index * SHA_DIGEST_LENGTH,
+      .offset = (int64_t)piece->index * sw->piece_length,
+  };
+  if (hasher_submit(&sw->hasher, &job) == 0) {
+    return 0;
+  }
+  job.verified = verify_piece(piece->data, piece->size, job.hash) == 0;
+  job.written = job.verified && storage_write(&sw->storage, job.offset,
+                                              piece->data, piece->size) == 0;
+  return swarm_piece_checked(sw, &job);
+}
+
+// Withdraw a block's duplicate requests from every other peer once it has
+// arrived.
+int32_t swarm_cancel(swarm_t *sw, peer_t *from, request_t *req) {
+  uint8_t msg[17];
+  *(uint32_t *)msg = htonl(13);
+  msg[4] = 8;
+  *(uint32_t *)(msg + 5) = htonl(req->index);
+  *(uint32_t *)(msg + 9) = htonl(req->begin);
+  *(uint32_t *)(msg + 13) = htonl(req->length);
+  for (int32_t i = 0; i < sw->npeers; ++i) {
+    peer_t *p = &sw->peers[i];
+    if (p == from || !peer_connected(p)) {
+      continue;
+    }
+    for (uint32_t k = 0; k < p->inflight; ++k) {
+      if (p->requests[k].index == req->index &&
+          p->requests[k].begin == req->begin) {
+        p->requests[k] = p->requests[--p->inflight];
+        if (peer_send(p, msg, 17) != 0) {
+          peer_close(sw, p);
+        }
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+void peer_count_block(peer_t *p, int64_t rtt_us) {
+  uint32_t b = 0;
+  uint32_t nbuckets = sizeof(p->stats.rtt) / sizeof(p->stats.rtt[0]);
+  while (b + 1 < nbuckets && rtt_us > 1000LL << b) {
+    ++b;
+  }
+  ++p->stats.rtt[b];
+  ++p->stats.blocks;
+}
+
+uint32_t peer_find_request(peer_t *p, uint32_t index, uint32_t begin,
+                           uint32_t length) {
+  uint32_t i = 0;
+  while (i < p->inflight &&
+         (p->requests[i].index != index || p->requests[i].begin != begin ||
+          p->requests[i].length != length)) {
+    ++i;
+  }
+  return i;
+}
+
+// Where the payload of a block goes, given the header of its message: its
+// place in the piece if we asked this peer for it and nobody is delivering
+// it already, otherwise NULL to read it into the message buffer and drop
+// it. The block is claimed until peer_on_block sees the payload.
+uint8_t *peer_block_target(swarm_t *sw, peer_t *p, uint8_t *msg,
+                           uint32_t n) {
+  uint32_t index = ntohl(*(uint32_t *)(msg + 1));
+  uint32_t begin = ntohl(*(uint32_t *)(msg + 5));
+  if (peer_find_request(p, index, begin, n - 9) == p->inflight) {
+    return NULL;
+  }
+  piece_t *piece = sw->sched.pieces[index];
+  uint32_t block = begin / BLOCK_SIZE;
+  if (piece == NULL || piece->blocks[block] != BLOCK_REQUESTED) {
+    return NULL;
+  }
+  piece->blocks[block] = BLOCK_RECEIVING;
+  return piece->data + begin;
+}
+
+int32_t peer_on_block(swarm_t *sw, peer_t *p, uint8_t *msg, uint32_t n) {
+  if (n < 9) {
+    return 1;
+  }
+  uint32_t index = ntohl(*(uint32_t *)(msg + 1));
+  uint32_t begin = ntohl(*(uint32_t *)(msg + 5));
+  uint32_t length = n - 9;
+  uint32_t i = peer_find_request(p, index, begin, length);
+  if (p->body == NULL) {
+    // unrequested, raced with a cancel or another peer's copy in endgame
+    if (index < sw->sched.npieces && sw->sched.state[index] != PIECE_MISSING) {
+      sw->dup_bytes += length;
+    }
+    if (i != p->inflight) {
+      p->requests[i] = p->requests[--p->inflight];
+    }
+    return 0;
+  }
+
+  // the payload is already in place
+  p->body = NULL;
+  piece_t *piece = sw->sched.pieces[index];
+  uint32_t block = begin / BLOCK_SIZE;
+  request_t req = p->requests[i];
+  pipeline_sample(&p->pl, req.sent_us, length);
+  p->requests[i] = p->requests[--p->inflight];
+  peer_count_block(p, now_us() - req.sent_us);
+  sw->downloaded += length;
+  p->last_block_us = now_us();
+  p->snubbed = false;
+
+  piece->blocks[block] = BLOCK_RECEIVED;
+  piece->sources[block] = p - sw->peers;
+  piece->conns[block] = p->conn;
+  if (piece->requesters[block] > 1) {
+    swarm_cancel(sw, p, &req);
+  }
+  if (++piece->received == piece->nblocks) {
+    return swarm_piece_done(sw, piece);
+  }
+  return 0;
+}
+
+// An extension protocol message. The peer's handshake tells us its id for
+// ut_metadata, and its requests for pieces of the info dict are answered
+// from ours.
+int32_t peer_on_extended(swarm_t *sw, peer_t *p, uint8_t *msg, uint32_t n) {
+  if (!p->extended || n < 2) {
+    return 0;
+  }
+  bedoc_t doc;
+  if (be_parse((char *)msg + 2, n - 2, &doc) != 0) {
+    return 1;
+  }
+  int32_t ret = 0;
+  bevalue_t *v = &doc.root;
+  int64_t type, piece;
+  if (v->type != BE_VEC || !v->val.vec.is_dict) {
+    ret = 1;
+  } else if (msg[1] == 0) {
+    bevalue_t *m = bevec_dict_get(&v->val.vec, "m");
+    int64_t id = 0;
+    if (m != NULL && m->type == BE_VEC &&
+        be_dict_int(&m->val.vec, "ut_metadata", &id) && id > 0 && id < 256) {
+      p->ut_metadata = id;
+    }
+  } else if (msg[1] == UT_METADATA_ID && p->ut_metadata != 0 &&
+             be_dict_int(&v->val.vec, "msg_type", &type) && type == 0 &&
+             be_dict_int(&v->val.vec, "piece", &piece)) {
+    uint8_t hdr[80];
+    // the piece is checked before it is multiplied, it may be anything
+    int64_t npieces = (sw->info_len + METADATA_PIECE - 1) / METADATA_PIECE;
+    if (piece < 0 || piece >= npieces) {
+      ret = peer_send(p, hdr,
+                      build_metadata_message(hdr, p->ut_metadata, 2, piece,
+                                             0, 0));
+    } else {
+      int64_t begin = piece * METADATA_PIECE;
+      uint32_t len = min64(sw->info_len - begin, METADATA_PIECE);
+      ret = peer_send(p, hdr,
+                      build_metadata_message(hdr, p->ut_metadata, 1, piece,
+                                             sw->info_len, len)) != 0 ||
+            peer_send(p, (uint8_t *)sw->info + begin, len) != 0;
+    }
+  }
+  bedoc_free(&doc);
+  return ret;
+}
+
+// The peer will not send a block we asked for, someone else may.
+int32_t peer_on_reject(swarm_t *sw, peer_t *p, uint8_t *msg, uint32_t n) {
+  if (n != 13) {
+    return 1;
+  }
+  uint32_t index = ntohl(*(uint32_t *)(msg + 1));
+  uint32_t begin = ntohl(*(uint32_t *)(msg + 5));
+  uint32_t length = ntohl(*(uint32_t *)(msg + 9));
+  uint32_t i = peer_find_request(p, index, begin, length);
+  if (i == p->inflight) {
+    return 0; // given up on already
+  }
+  scheduler_unrequest(&sw->sched, index, begin);
+  p->requests[i] = p->requests[--p->inflight];
+  sw->refill = true;
+  return 0;
+}
+
+int32_t peer_on_message(swarm_t *sw, peer_t *p, uint8_t *msg, uint32_t n) {
+  if (n == 0) {
+    return 0; // keep-alive
+  }
+
+  // the Fast Extension messages, from a peer that did not offer it
+  if (msg[0] >= 0x0D && msg[0] <= 0x11 && !p->fast) {
+    return 1;
+  }
+
+  // whatever the first message is, the peer has told us what it has
+  if (p->state == PEER_BITFIELD) {
+    if (msg[0] == 5 || msg[0] == 0x0E) {
+      uint32_t npieces = sw->sched.npieces;
+      if (msg[0] == 5) {
+        memcpy(p->bitfield, msg + 1, min(n - 1, (npieces + 7) / 8));
+      } else {
+        memset(p->bitfield, 0xff, (npieces + 7) / 8);
+      }
+      // spare bits past the last piece must be ignored
+      if (npieces % 8 != 0) {
+        p->bitfield[npieces / 8] &= 0xff << (8 - npieces % 8);
+      }
+      picker_apply_bitfield(&sw->sched.picker, p->bitfield, npieces, true);
+    }
+    p->state = PEER_CHOKED;
+    p->stats.choked_since_us = now_us();
+  }
+
+  switch (msg[0]) {
+  case 0: // choke, the peer discards our pending requests
+    if (p->state == PEER_ACTIVE) {
+      // but for the pieces it allowed us, under the Fast Extension
+      peer_unrequest(sw, p, p->fast);
+      p->state = PEER_CHOKED;
+      p->stats.choked_since_us = now_us();
+    }
+    break;
+  case 1: // unchoke
+    if (sw->first_unchoke_us == 0) {
+      sw->first_unchoke_us = now_us();
+    }
+    if (p->state == PEER_CHOKED) {
+      p->state = PEER_ACTIVE;
+      p->stats.choked_us += now_us() - p->stats.choked_since_us;
+    }
+    break;
+  case 2: // interested, unchoked right away while a slot is free
+    p->peer_interested = true;
+    if (p->peer_choked && swarm_unchoked(sw) < UNCHOKE_SLOTS) {
+      return peer_set_choked(p, false);
+    }
+    break;
+  case 3: // not interested, its slot goes to someone who is
+    p->peer_interested = false;
+    sw->slot_freed |= !p->peer_choked;
+    return peer_set_choked(p, true);
+  case 4: // have
+    if (n == 5) {
+      uint32_t index = ntohl(*(uint32_t *)(msg + 1));
+      if (index < sw->sched.npieces && !bitfield_has(p->bitfield, index)) {
+        bitfield_set(p->bitfield, index);
+        picker_inc(&sw->sched.picker, index);
+      }
+    }
+    break;
+  case 6: // request
+    return peer_on_request(sw, p, msg, n);
+  case 7: // piece
+    return peer_on_block(sw, p, msg, n);
+  case 8: // cancel
+    return peer_on_cancel(p, msg, n);
+  case 0x0D: // suggest piece, kept as a preference for the next pick
+    if (n == 5) {
+      uint32_t index = ntohl(*(uint32_t *)(msg + 1));
+      if (index < sw->sched.npieces &&
+          !list_has(p->suggested, p->nsuggested, index)) {
+        if (p->nsuggested == 8) {
+          memmove(p->suggested, p->suggested + 1, 7 * sizeof(uint32_t));
+          --p->nsuggested;
+        }
+        p->suggested[p->nsuggested++] = index;
+      }
+    }
+    break;
+  case 0x10: // reject request
+    return peer_on_reject(sw, p, msg, n);
+  case 0x11: // allowed fast
+    if (n == 5) {
+      uint32_t index = ntohl(*(uint32_t *)(msg + 1));
+      if (index < sw->sched.npieces && p->nallowed < 32 &&
+          !list_has(p->allowed, p->nallowed, index)) {
+        p->allowed[p->nallowed++] = index;
+      }
+    }
+    break;
+  case 20: // extended
+    return peer_on_extended(sw, p, msg, n);
+  }
+  return 0;
+}
+
+// Decode every complete message in the receive buffer in place, and keep
+// what is left of the last one for the next read. A wanted block whose
+// payload is not all in yet has what is there copied to its place in the
+// piece, and the rest is received straight after it.
+int32_t peer_decode(swarm_t *sw, peer_t *p) {
+  uint8_t *s = p->in;
+  uint8_t *end = p->in + p->in_len;
+  if (p->state == PEER_HANDSHAKE) {
+    if (end - s < 68) {
+      return 0;
+    }
+    // the tracker may hand us our own address
+    if (s[0] != 19 || memcmp(s + 28, sw->info_hash, SHA_DIGEST_LENGTH) != 0 ||
+        memcmp(s + 48, sw->peer_id, 20) == 0) {
+      return 1;
+    }
+    p->fast = (s[27] & 0x04) != 0;
+    p->extended = (s[25] & 0x10) != 0;
+    // a peer that connected to us hears from us only now
+    if ((p->incoming && peer_send_greeting(sw, p) != 0) ||
+        peer_send_allowed_fast(sw, p) != 0 ||
+        peer_send_extended_handshake(sw, p) != 0) {
+      return 1;
+    }
+    p->state = PEER_BITFIELD;
+    s += 68;
+  }
+
+  while (end - s >= 4 && p->state != PEER_CLOSED) {
+    uint32_t len = ntohl(*(uint32_t *)s);
+    uint32_t avail = end - s - 4;
+    if (len > sw->max_message) {
+      return 1;
+    }
+    if (avail < len) {
+      if (avail >= 9 && s[4] == 7 &&
+          (p->body = peer_block_target(sw, p, s + 4, len)) != NULL) {
+        memcpy(p->block, s + 4, 9);
+        p->msg_len = len;
+        p->body_len = avail - 9;
+        memcpy(p->body, s + 13, p->body_len);
+        s = end;
+      }
+      break;
+    }
+    if (len > 9 && s[4] == 7 &&
+        (p->body = peer_block_target(sw, p, s + 4, len)) != NULL) {
+      memcpy(p->body, s + 13, len - 9);
+    }
+    if (peer_on_message(sw, p, s + 4, len) != 0) {
+      return 1;
+    }
+    s += 4 + len;
+  }
+  p->in_len = end - s;
+  if (s != p->in) {
+    memmove(p->in, s, p->in_len);
+  }
+  return 0;
+}
+
+// Read as much as the socket has, a wanted block's payload into its piece
+// and everything else into the receive buffer, in one call for both, and
+// decode it.
+int32_t peer_on_readable(swarm_t *sw, peer_t *p) {
+  for (;;) {
+    struct iovec iov[2];
+    int32_t niov = 0;
+    uint32_t body_left = p->body != NULL ? p->msg_len - 9 - p->body_len : 0;
+    if (body_left != 0) {
+      iov[niov++] = (struct iovec){p->body + p->body_len, body_left};
+    }
+    iov[niov++] = (struct iovec){p->in + p->in_len, sw->in_cap - p->in_len};
+    size_t want = body_left + sw->in_cap - p->in_len;
+    ssize_t n = readv(p->fd, iov, niov);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    if (n <= 0) {
+      return 1;
+    }
+    p->deadline_us = now_us() + PEER_TIMEOUT * 1000000LL;
+    p->stats.bytes_in += n;
+    uint32_t k = min(n, body_left);
+    p->body_len += k;
+    p->in_len += n - k;
+    if (k == body_left && k != 0 &&
+        peer_on_message(sw, p, p->block, p->msg_len) != 0) {
+      return 1;
+    }
+    if (p->state != PEER_CLOSED && peer_decode(sw, p) != 0) {
+      return 1;
+    }
+    // a short read emptied the socket
+    if (p->state == PEER_CLOSED || (size_t)n < want) {
+      return 0;
+    }
+  }
+}
+
+int32_t peer_on_connected(swarm_t *sw, peer_t *p) {
+  int32_t err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+    return 1;
+  }
+  p->state = PEER_HANDSHAKE;
+  --sw->dialing;
+  if (peer_send_greeting(sw, p) != 0) {
+    return 1;
+  }
+  p->deadline_us = now_us() + CONNECT_TIMEOUT * 1000000LL;
+  return 0;
+}
+
+void peer_free(peer_t *p) {
+  free(p->bitfield);
+  free(p->in);
+  free(p->out);
+  free(p->requests);
+  free(p->uploads);
+}
+
+// Set up a slot for a new connection.
+int32_t peer_init(swarm_t *sw, peer_t *p, uint8_t *info) {
+  memset(p, 0, sizeof(peer_t));
+  p->conn = ++sw->connections;
+  memcpy(p->info, info, PEER_INFO_SIZE);
+  p->state = PEER_CLOSED;
+  p->peer_choked = true;
+  p->candidate = -1;
+  p->connected_us = now_us();
+  p->written_us = p->connected_us;
+  pipeline_init(&p->pl);
+  p->bitfield = (uint8_t *)calloc((sw->sched.npieces + 7) / 8, 1);
+  p->in = (uint8_t *)malloc(sw->in_cap);
+  p->requests = (request_t *)malloc(MAX_QUEUE_DEPTH * sizeof(request_t));
+  p->uploads = (request_t *)malloc(MAX_UPLOAD_QUEUE * sizeof(request_t));
+  if (p->bitfield == NULL || p->in == NULL || p->requests == NULL ||
+      p->uploads == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Our messages are gathered into one write per round, so Nagle's
+// algorithm only delays them unless asked for.
+void swarm_tune_socket(swarm_t *sw, int32_t fd) {
+  int32_t one = 1;
+  if (!sw->nagle) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  if (sw->zerocopy) {
+    setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+  }
+}
+
+int32_t peer_open(swarm_t *sw, peer_t *p, uint8_t *info) {
+  if (peer_init(sw, p, info) != 0) {
+    return 1;
+  }
+
+  struct sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_port = *(uint16_t *)(info + 4);
+  addr.sin_addr.s_addr = *(uint32_t *)info;
+  p->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (p->fd < 0) {
+    perror("Failed to create socket");
+    return 1;
+  }
+  swarm_tune_socket(sw, p->fd);
+  if (connect(p->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 &&
+      errno != EINPROGRESS) {
+    close(p->fd);
+    return 0;
+  }
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = p};
+  if (epoll_ctl(sw->epfd, EPOLL_CTL_ADD, p->fd, &ev) != 0) {
+    perror("Failed to register socket");
+    close(p->fd);
+    return 1;
+  }
+  p->state = PEER_CONNECTING;
+  p->want_write = true;
+  p->deadline_us = now_us() + CONNECT_TIMEOUT * 1000000LL;
+  ++sw->live;
+  ++sw->dialing;
+  return 0;
+}
+
+// Take over a connection a peer made to us. It speaks first.
+int32_t peer_accept(swarm_t *sw, peer_t *p, int32_t fd, uint8_t *info) {
+  if (peer_init(sw, p, info) != 0) {
+    close(fd);
+    return 1;
+  }
+  p->fd = fd;
+  p->incoming = true;
+  swarm_tune_socket(sw, fd);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = p};
+  if (epoll_ctl(sw->epfd, EPOLL_CTL_ADD, p->fd, &ev) != 0) {
+    perror("Failed to register socket");
+    close(p->fd);
+    return 1;
+  }
+  p->state = PEER_HANDSHAKE;
+  p->deadline_us = now_us() + CONNECT_TIMEOUT * 1000000LL;
+  ++sw->live;
+  return 0;
+}
+
+// Drop the notices that zerocopy sends completed. What they sent are the
+// pages of verified pieces, which never change, so nothing waits on them.
+void peer_reap_zerocopy(peer_t *p) {
+  uint8_t control[256];
+  for (;;) {
+    struct msghdr msg = {.msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    if (recvmsg(p->fd, &msg, MSG_ERRQUEUE) < 0) {
+      return;
+    }
+  }
+}
+
+int32_t peer_on_event(swarm_t *sw, peer_t *p, uint32_t events) {
+  if (p->state == PEER_CONNECTING) {
+    if (peer_on_connected(sw, p) != 0) {
+      return 1;
+    }
+  } else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    if (peer_on_readable(sw, p) != 0) {
+      return 1;
+    }
+  }
+  if ((events & EPOLLERR) && sw->zerocopy) {
+    peer_reap_zerocopy(p);
+  }
+  // requests and uploads go out with the rest of the round's messages
+  p->dirty = true;
+  return peer_fill_requests(sw, p);
+}
+
+const char *PEER_STATE_NAMES[] = {"connecting", "handshake", "bitfield",
+                                  "choked",     "active",    "closed"};
+
+// Write one line of metrics: totals for the torrent followed by every open
+// connection. Rates are over the time since the previous line.
+void metrics_write(swarm_t *sw) {
+  metrics_t *m = &sw->metrics;
+  int64_t now = now_us();
+  double rate = now > m->last_us ? (sw->downloaded - m->last_downloaded) *
+                                       1e6 / (now - m->last_us)
+                                 : 0;
+  m->last_us = now;
+  m->last_downloaded = sw->downloaded;
+
+  hasher_t *h = &sw->hasher;
+  pthread_mutex_lock(&h->lock);
+  uint32_t collectable = h->done_len;
+  pthread_mutex_unlock(&h->lock);
+  uint32_t writing = __atomic_load_n(&h->writing, __ATOMIC_RELAXED);
+  uint32_t hashing = h->pending - collectable - writing;
+
+  fprintf(m->out,
+          "{\"time\":%.3f,\"downloaded\":%lu,\"rate\":%.0f,"
+          "\"wanted\":%u,\"verified\":%u,\"active\":%u,"
+          "\"hash_failures\":%u,\"hash_queue\":%u,\"disk_queue\":%u,"
+          "\"duplicate\":%lu,\"uploaded\":%lu,\"first_unchoke_ms\":%.1f,"
+          "\"peers\":[",
+          (now - m->start_us) / 1e6, sw->downloaded, rate, sw->sched.wanted,
+          sw->sched.done, sw->sched.nactive, sw->hash_failures, hashing,
+          writing, sw->dup_bytes, sw->uploaded,
+          sw->first_unchoke_us == 0
+              ? 0
+              : (sw->first_unchoke_us - m->start_us) / 1e3);
+  bool first = true;
+  for (int32_t i = 0; i < sw->npeers; ++i) {
+    peer_t *p = &sw->peers[i];
+    if (p->state == PEER_CLOSED) {
+      continue;
+    }
+    peer_stats_t *st = &p->stats;
+    int64_t choked = st->choked_us +
+                     (p->state == PEER_CHOKED ? now - st->choked_since_us : 0);
+    fprintf(m->out,
+            "%s{\"addr\":\"%d.%d.%d.%d:%d\",\"state\":\"%s\","
+            "\"in\":%lu,\"out\":%lu,\"blocks\":%u,\"inflight\":%u,"
+            "\"depth\":%u,\"rate\":%.0f,\"min_rtt_us\":%ld,"
+            "\"choked_ms\":%ld,\"hash_failures\":%u,\"unchoked\":%s,"
+            "\"snubbed\":%s,\"rtt\":[",
+            first ? "" : ",", p->info[0], p->info[1], p->info[2], p->info[3],
+            ntohs(*(uint16_t *)(p->info + 4)), PEER_STATE_NAMES[p->state],
+            st->bytes_in, st->bytes_out, st->blocks, p->inflight, p->pl.depth,
+            p->pl.rate, p->pl.min_rtt_us, choked / 1000, st->hash_failures,
+            p->peer_choked ? "false" : "true", p->snubbed ? "true" : "false");
+    for (uint32_t b = 0; b < sizeof(st->rtt) / sizeof(st->rtt[0]); ++b) {
+      fprintf(m->out, "%s%u", b == 0 ? "" : ",", st->rtt[b]);
+    }
+    fprintf(m->out, "]}");
+    first = false;
+  }
+  fprintf(m->out, "]}\n");
+  fflush(m->out);
+}
+
+// Rank the interested peers by how fast they sent to us over the last
+// round, or how fast they took from us once there is nothing left to
+// download, and unchoke the best UNCHOKE_SLOTS. Snubbed peers are not
+// ranked. One more unchoke rotates every OPTIMISTIC_ROUNDS rounds to a
+// random choked peer, newcomers three times as likely, so peers we have
+// not traded with yet get a chance to show their rate.
+void swarm_choke(swarm_t *sw) {
+  int64_t now = now_us();
+  double elapsed = (now - sw->choke_last_us) / 1e6;
+  bool seeding = sw->sched.done == sw->sched.wanted;
+  sw->choke_last_us = now;
+  for (int32_t i = 0; i < sw->npeers; ++i) {
+    peer_t *p = &sw->peers[i];
+    p->down_rate = (p->stats.bytes_in - p->round_in) / elapsed;
+    p->up_rate = (p->stats.bytes_out - p->round_out) / elapsed;
+    p->round_in = p->stats.bytes_in;
+    p->round_out = p->stats.bytes_out;
+    p->unchoke = false;
+  }
+
+  for (int32_t k = 0; k < UNCHOKE_SLOTS; ++k) {
+    peer_t *best = NULL;
+    for (int32_t i = 0; i < sw->npeers; ++i) {
+      peer_t *p = &sw->peers[i];
+      if (!peer_connected(p) || !p->peer_interested || p->unchoke ||
+          (p->snubbed && !seeding)) {
+        continue;
+      }
+      double rate = seeding ? p->up_rate : p->down_rate;
+      if (best == NULL ||
+          rate > (seeding ? best->up_rate : best->down_rate)) {
+        best = p;
+      }
+    }
+    if (best == NULL) {
+      break;
+    }
+    best->unchoke = true;
+  }
+
+  peer_t *opt = sw->optimistic >= 0 ? &sw->peers[sw->optimistic] : NULL;
+  if (sw->choke_round++ % OPTIMISTIC_ROUNDS == 0 || opt == NULL ||
+      opt->state == PEER_CLOSED || !opt->peer_interested || opt->unchoke) {
+    uint32_t tickets = 0;
+    for (int32_t i = 0; i < sw->npeers; ++i) {
+      peer_t *p = &sw->peers[i];
+      if (peer_connected(p) && p->peer_interested && !p->unchoke) {
+        tickets += now - p->connected_us < 3 * CHOKE_INTERVAL ? 3 : 1;
+      }
+    }
+    sw->optimistic = -1;
+    uint32_t pick = 0;
+    RAND_bytes((uint8_t *)&pick, sizeof(pick));
+    pick = tickets != 0 ? pick % tickets : 0;
+    for (int32_t i = 0; tickets != 0 && i < sw->npeers; ++i) {
+      peer_t *p = &sw->peers[i];
+      if (peer_connected(p) && p->peer_interested && !p->unchoke) {
+        uint32_t t = now - p->connected_us < 3 * CHOKE_INTERVAL ? 3 : 1;
+        if (pick < t) {
+          sw->optimistic = i;
+          break;
+        }
+        pick -= t;
+      }
+    }
+  }
+  if (sw->optimistic >= 0) {
+    sw->peers[sw->optimistic].unchoke = true;
+  }
+
+  for (int32_t i = 0; i < sw->npeers; ++i) {
+    peer_t *p = &sw->peers[i];
+    if (peer_connected(p) && peer_set_choked(p, !p->unchoke) != 0) {
+      peer_close(sw, p);
+      sw->refill = true;
+    }
+  }
+}
+
+volatile sig_atomic_t interrupted = 0;
+
+void on_interrupt(int32_t sig) { interrupted = 1; }
+
+// A slot for a new connection: an unused one, or else the slot of a
+// closed connection. NULL when all are taken.
+peer_t *swarm_slot(swarm_t *sw) {
+  if (sw->npeers < MAX_PEERS) {
+    return &sw->peers[sw->npeers++];
+  }
+  for (int32_t i = 0; i < sw->npeers; ++i) {
+    if (sw->peers[i].state == PEER_CLOSED) {
+      peer_free(&sw->peers[i]);
+      return &sw->peers[i];
+    }
+  }
+  return NULL;
+}
+
+// Remember a peer the tracker named, to be dialed with the next free slot.
+void swarm_add_peer(void *ctx, uint8_t *info) {
+  swarm_t *sw = (swarm_t *)ctx;
+  for (uint32_t i = 0; i < sw->ncandidates; ++i) {
+    if (memcmp(sw->candidates[i].info, info, PEER_INFO_SIZE) == 0) {
+      return;
+    }
+  }
+  if (sw->ncandidates == MAX_CANDIDATES) {
+    return;
+  }
+  candidate_t *c = &sw->candidates[sw->ncandidates++];
+  memcpy(c->info, info, PEER_INFO_SIZE);
+  c->slot = -1;
+  c->fails = 0;
+  c->retry_us = 0;
+  sw->dial_due_us = 0;
+}
+
+// Dial candidates, round robin, while fewer than MAX_CONNECTING
+// connections are in progress and slots are free. Peers that failed wait
+// out their backoff.
+void swarm_dial(swarm_t *sw) {
+  int64_t now = now_us();
+  if (now < sw->dial_due_us) {
+    return;
+  }
+  int64_t due = INT64_MAX;
+  for (uint32_t k = 0; k < sw->ncandidates; ++k) {
+    if (sw->dialing >= MAX_CONNECTING) {
+      // check again once one of them is through
+      due = now;
+      break;
+    }
+    uint32_t i = sw->next_candidate;
+    sw->next_candidate = (i + 1) % sw->ncandidates;
+    candidate_t *c = &sw->candidates[i];
+    if (c->slot >= 0) {
+      continue;
+    }
+    if (c->retry_us > now) {
+      due = min64(due, c->retry_us);
+      continue;
+    }
+    peer_t *p = swarm_slot(sw);
+    if (p == NULL) {
+      due = now;
+      break;
+    }
+    peer_open(sw, p, c->info);
+    if (p->state == PEER_CLOSED) {
+      // refused on the spot
+      candidate_retry(sw, c, true);
+      due = min64(due, c->retry_us);
+      continue;
+    }
+    p->candidate = i;
+    c->slot = p - sw->peers;
+  }
+  sw->dial_due_us = due;
+}
+
+// Whether a candidate we are not connected to may still be dialed.
+bool swarm_can_redial(swarm_t *sw) {
+  for (uint32_t i = 0; i < sw->ncandidates; ++i) {
+    candidate_t *c = &sw->candidates[i];
+    if (c->slot < 0 && c->retry_us != INT64_MAX) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Accept the peers waiting to connect to us.
+void swarm_accept(swarm_t *sw) {
+  for (;;) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int32_t fd = accept4(sw->listen_fd, (struct sockaddr *)&addr, &len,
+                         SOCK_NONBLOCK);
+    if (fd < 0) {
+      return;
+    }
+    peer_t *p = swarm_slot(sw);
+    if (p == NULL) {
+      close(fd);
+      continue;
+    }
+    uint8_t info[6];
+    memcpy(info, &addr.sin_addr.s_addr, 4);
+    memcpy(info + 4, &addr.sin_port, 2);
+    peer_accept(sw, p, fd, info);
+  }
+}
+
+// Listen for peers on sw->port.
+int32_t swarm_listen(swarm_t *sw) {
+  sw->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (sw->listen_fd < 0) {
+    perror("Failed to create socket");
+    return 1;
+  }
+  int32_t one = 1;
+  setsockopt(sw->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(sw->port),
+                             .sin_addr.s_addr = htonl(INADDR_ANY)};
+  if (bind(sw->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(sw->listen_fd, 128) != 0) {
+    perror("Failed to listen for peers");
+    close(sw->listen_fd);
+    sw->listen_fd = -1;
+    return 1;
+  }
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &sw->listen_fd};
+  if (epoll_ctl(sw->epfd, EPOLL_CTL_ADD, sw->listen_fd, &ev) != 0) {
+    perror("Failed to register socket");
+    return 1;
+  }
+  return 0;
+}
+
+// Bytes of the torrent we do not have yet, for the tracker.
+int64_t swarm_left(swarm_t *sw) {
+  int64_t left = 0;
+  for (uint32_t i = 0; i < sw->sched.npieces; ++i) {
+    if (sw->sched.state[i] != PIECE_DONE) {
+      left += piece_size(sw->total_length, sw->piece_length, i);
+    }
+  }
+  return left;
+}
+
+// Drive the announce and all peer connections from a single epoll loop
+// until every wanted piece is done or no usable peer is left.
+int32_t swarm_run(swarm_t *sw, tracker_t *tr) {
+  if (sw->sched.done == sw->sched.wanted && !sw->seeding) {
+    return 0;
+  }
+  sw->npeers = 0;
+  sw->live = 0;
+  sw->dup_bytes = 0;
+  sw->downloaded = 0;
+  sw->uploaded = 0;
+  sw->hash_failures = 0;
+  sw->connections = 0;
+  sw->listen_fd = -1;
+  sw->refill = false;
+  sw->slot_freed = false;
+  sw->choke_last_us = now_us();
+  sw->choke_due_us = sw->choke_last_us + CHOKE_INTERVAL;
+  sw->choke_round = 0;
+  sw->optimistic = -1;
+  sw->ncandidates = 0;
+  sw->next_candidate = 0;
+  sw->dialing = 0;
+  sw->dial_due_us = 0;
+  sw->first_unchoke_us = 0;
+  sw->metrics.start_us = sw->metrics.last_us = now_us();
+  sw->metrics.next_us = sw->metrics.start_us + METRICS_INTERVAL;
+  sw->metrics.last_downloaded = 0;
+  sw->max_message = max(BLOCK_SIZE + 9, (sw->sched.npieces + 7) / 8 + 1);
+  sw->in_cap = 4 + sw->max_message + RECV_BUFFER;
+  sw->epfd = -1;
+  RAND_bytes(sw->peer_id, 20);
+
+  // everything from here on is torn down at out, however far it got
+  int32_t ret = 1;
+  bool hashing = false;
+  struct epoll_event events[64];
+  hash_job_t checked[64];
+  sw->peers = (peer_t *)calloc(MAX_PEERS, sizeof(peer_t));
+  sw->candidates =
+      (candidate_t *)malloc(MAX_CANDIDATES * sizeof(candidate_t));
+  if (sw->peers == NULL || sw->candidates == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    goto out;
+  }
+  for (int32_t i = 0; i < sw->nknown; ++i) {
+    swarm_add_peer(sw, sw->known + i * PEER_INFO_SIZE);
+  }
+  if ((sw->epfd = epoll_create1(0)) < 0) {
+    perror("Failed to create epoll instance");
+    goto out;
+  }
+  hashing = true;
+  if (hasher_init(&sw->hasher, &sw->storage, HASH_QUEUE_DEPTH) != 0) {
+    goto out;
+  }
+  struct epoll_event hev = {.events = EPOLLIN, .data.ptr = &sw->hasher};
+  if (epoll_ctl(sw->epfd, EPOLL_CTL_ADD, sw->hasher.efd, &hev) != 0) {
+    perror("Failed to register eventfd");
+    goto out;
+  }
+
+  struct epoll_event tev = {.events = EPOLLIN, .data.ptr = tr};
+  if (epoll_ctl(sw->epfd, EPOLL_CTL_ADD, tr->epfd, &tev) != 0) {
+    perror("Failed to register tracker");
+    goto out;
+  }
+  // a seed is nothing without incoming peers, a download can do without
+  if (sw->port != 0 && swarm_listen(sw) != 0 && sw->seeding) {
+    goto out;
+  }
+
+  ret = 0;
+  tracker_poll(tr);
+  swarm_dial(sw);
+  while (!interrupted &&
+         (sw->seeding ||
+          (sw->sched.done != sw->sched.wanted &&
+           (sw->live > 0 || sw->hasher.pending > 0 || tr->running ||
+            swarm_can_redial(sw))))) {
+    int32_t n = epoll_wait(sw->epfd, events, 64, tracker_timeout(tr, 250));
+    if (n < 0 && errno != EINTR) {
+      perror("Failed to wait for events");
+      ret = 1;
+      goto out;
+    }
+    bool dropped = false;
+    for (int32_t i = 0; i < n; ++i) {
+      if (events[i].data.ptr == tr) {
+        continue;
+      }
+      if (events[i].data.ptr == &sw->listen_fd) {
+        swarm_accept(sw);
+        continue;
+      }
+      if (events[i].data.ptr == &sw->hasher) {
+        uint32_t k = hasher_collect(&sw->hasher, checked, 64);
+        for (uint32_t j = 0; j < k; ++j) {
+          if (swarm_piece_checked(sw, &checked[j]) != 0) {
+            ret = 1;
+            goto out;
+          }
+          // a failed piece is up for grabs again
+          dropped |= !checked[j].verified;
+        }
+        continue;
+      }
+      peer_t *p = (peer_t *)events[i].data.ptr;
+      if (p->state != PEER_CLOSED &&
+          peer_on_event(sw, p, events[i].events) != 0) {
+        peer_close(sw, p);
+        dropped = true;
+      }
+    }
+
+    tracker_poll(tr);
+    swarm_dial(sw);
+
+    int64_t now = now_us();
+    if (sw->metrics.out != NULL && now >= sw->metrics.next_us) {
+      metrics_write(sw);
+      sw->metrics.next_us = now + METRICS_INTERVAL;
+    }
+    if (now >= sw->choke_due_us) {
+      swarm_choke(sw);
+      sw->choke_due_us = now + CHOKE_INTERVAL;
+      // for the next announce
+      tr->left = swarm_left(sw);
+      tr->downloaded = sw->downloaded;
+      tr->uploaded = sw->uploaded;
+    } else if (sw->slot_freed) {
+      swarm_fill_slots(sw);
+    }
+    sw->slot_freed = false;
+    for (int32_t i = 0; i < sw->npeers; ++i) {
+      peer_t *p = &sw->peers[i];
+      // an unchoked peer with nothing to fetch from it is not stalling us
+      bool idle = p->state == PEER_ACTIVE && p->inflight == 0;
+      if (p->state != PEER_CLOSED && !idle && now > p->deadline_us) {
+        peer_close(sw, p);
+        dropped = true;
+      } else if (p->state == PEER_ACTIVE && !p->snubbed && p->body == NULL &&
+                 p->inflight != 0 && now - p->last_block_us > SNUB_TIMEOUT) {
+        // alive but not sending, someone else fetches its blocks
+        p->snubbed = true;
+        peer_unrequest(sw, p, false);
+      }
+      if (peer_connected(p) &&
+          now - p->written_us > KEEPALIVE_INTERVAL * 1000000LL) {
+        // so that a peer we have nothing to say to does not drop us
+        uint8_t keepalive[4] = {0};
+        p->written_us = now;
+        if (peer_send(p, keepalive, 4) != 0) {
+          peer_close(sw, p);
+          dropped = true;
+        }
+      }
+    }
+    dropped |= sw->refill;
+    sw->refill = false;
+
+    // blocks a dropped peer had requested are up for grabs again
+    for (int32_t i = 0; dropped && i < sw->npeers; ++i) {
+      peer_t *p = &sw->peers[i];
+      if (p->state != PEER_CLOSED && peer_fill_requests(sw, p) != 0) {
+        peer_close(sw, p);
+      }
+    }
+
+    // one write per peer for all it was sent this round
+    for (int32_t i = 0; i < sw->npeers; ++i) {
+      peer_t *p = &sw->peers[i];
+      if (p->state != PEER_CLOSED && p->dirty && peer_flush(sw, p) != 0) {
+        peer_close(sw, p);
+        sw->refill = true;
+      }
+    }
+  }
+
+  if (sw->seeding) {
+    fprintf(stderr, "Uploaded %lu bytes\n", sw->uploaded);
+  } else if (interrupted) {
+    fprintf(stderr, "Interrupted with %d of %d pieces downloaded\n",
+            sw->sched.done, sw->sched.wanted);
+    ret = 1;
+  } else if (sw->sched.done != sw->sched.wanted) {
+    fprintf(stderr, "Downloaded %d of %d pieces, no peer has the rest\n",
+            sw->sched.done, sw->sched.wanted);
+    ret = 1;
+  }
+  if (sw->sched.endgame) {
+    fprintf(stderr, "Endgame: %lu duplicate bytes\n", sw->dup_bytes);
+  }
+
+out:
+  // record whatever the workers still had in hand
+  if (hashing) {
+    hasher_stop(&sw->hasher);
+    for (uint32_t k; sw->hasher.efd >= 0 &&
+                     (k = hasher_collect(&sw->hasher, checked, 64)) != 0;) {
+      for (uint32_t j = 0; j < k; ++j) {
+        swarm_piece_checked(sw, &checked[j]);
+      }
+    }
+  }
+  if (sw->metrics.out != NULL) {
+    metrics_write(sw);
+  }
+  if (hashing) {
+    hasher_free(&sw->hasher);
+  }
+  for (int32_t i = 0; i < sw->npeers; ++i) {
+    peer_close(sw, &sw->peers[i]);
+    peer_free(&sw->peers[i]);
+  }
+  free(sw->peers);
+  free(sw->candidates);
+  if (sw->listen_fd >= 0) {
+    close(sw->listen_fd);
+  }
+  if (sw->epfd >= 0) {
+    close(sw->epfd);
+  }
+  return ret;
+}
+
+// Set up a swarm for the torrent. The caller marks the pieces it wants and
+// runs the swarm. Whether or not it succeeds, sw->sched is to be freed.
+int32_t swarm_init(swarm_t *sw, torrent_t *t) {
+  sw->resume = NULL;
+  sw->port = 0;
+  sw->seeding = false;
+  sw->nagle = false;
+  sw->zerocopy = false;
+  sw->metrics.out = NULL;
+  sw->hashes = t->hashes;
+  sw->info = t->info;
+  sw->info_len = t->info_len;
+  sw->known = NULL;
+  sw->nknown = 0;
+  sw->total_length = t->total_length;
+  sw->piece_length = t->piece_length;
+  memcpy(sw->info_hash, t->info_hash, SHA_DIGEST_LENGTH);
+  return scheduler_init(&sw->sched, t->npieces, MAX_PEERS);
+}
+
+// Lay out the torrent's files under root, or write to root itself for a
+// single file. Files of priority 0 are skipped, prio may be NULL to keep
+// them all. The path of each file goes to paths.
+int32_t swarm_open_files(swarm_t *sw, torrent_t *t, char *root, uint8_t *prio,
+                         char **paths) {
+  for (int32_t i = 0; i < t->nfiles; ++i) {
+    torrent_file_t *f = &t->files[i];
+    char path[strlen(root) + strlen(f->path) + 1];
+    sprintf(path, "%s%s", root, t->multi_file ? f->path + t->name.n : "");
+    if (storage_add(&sw->storage, path, f->offset, f->length,
+                    prio != NULL && prio[i] == 0) != 0) {
+      return 1;
+    }
+    paths[i] = sw->storage.files[i].path;
+  }
+  return 0;
+}
+
+// Append metrics to the given file while the swarm runs, if there is one.
+int32_t swarm_open_metrics(swarm_t *sw, char *path) {
+  if (path != NULL && (sw->metrics.out = fopen(path, "a")) == NULL) {
+    perror("Failed to open metrics file");
+    return 1;
+  }
+  return 0;
+}
+
+// Mark the pieces recorded in the resume file as done. Unless the data file
+// is known to be untouched since they were recorded, each one is hashed
+// again and dropped if it no longer matches.
+int32_t swarm_load_resume(swarm_t *sw, resume_t *rs, bool trusted) {
+  uint8_t *buf = (uint8_t *)malloc(sw->piece_length);
+  if (buf == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  for (uint32_t i = 0; i < sw->sched.npieces; ++i) {
+    if (!bitfield_has(rs->bitmap, i)) {
+      continue;
+    }
+    if (!trusted) {
+      uint32_t size = piece_size(sw->total_length, sw->piece_length, i);
+      uint8_t md[SHA_DIGEST_LENGTH];
+      // a piece that can no longer be read back is fetched again
+      bool ok = storage_read(&sw->storage, (int64_t)i * sw->piece_length, buf,
+                             size) == 0;
+      if (ok) {
+        SHA1(buf, size, md);
+        ok = memcmp(md, sw->hashes + i * SHA_DIGEST_LENGTH,
+                    SHA_DIGEST_LENGTH) == 0;
+      }
+      if (!ok) {
+        rs->bitmap[i / 8] &= ~(1 << (7 - i % 8));
+        continue;
+      }
+    }
+    scheduler_have(&sw->sched, i);
+  }
+  free(buf);
+  return 0;
+}
+
+// A magnet link (BEP 9): the info hash, and where to look for peers, its
+// trackers (tr) and peer addresses (x.pe).
+typedef struct {
+  uint8_t info_hash[SHA_DIGEST_LENGTH];
+  char *announce_list; // bencoded, one tier for each tracker, or NULL
+  int64_t announce_len;
+  uint8_t *peers; // compact ip:port
+  int32_t npeers;
+} magnet_t;
+
+void magnet_free(magnet_t *m) {
+  free(m->announce_list);
+  free(m->peers);
+}
+
+// Undo the percent-encoding of the n bytes at s into out, which has room
+// for n bytes. Returns the decoded length.
+int32_t url_unescape(char *s, int32_t n, char *out) {
+  int32_t k = 0;
+  for (int32_t i = 0; i < n; ++i) {
+    if (s[i] == '%' && i + 2 < n && isxdigit(s[i + 1]) &&
+        isxdigit(s[i + 2])) {
+      char hex[3] = {s[i + 1], s[i + 2], '\0'};
+      out[k++] = strtol(hex, NULL, 16);
+      i += 2;
+    } else {
+      out[k++] = s[i];
+    }
+  }
+  return k;
+}
+
+// An info hash in hex, or in base32 as older links have it.
+int32_t parse_btih(char *s, int32_t n, uint8_t *hash) {
+  if (n == 2 * SHA_DIGEST_LENGTH) {
+    for (int32_t i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+      if (!isxdigit(s[2 * i]) || !isxdigit(s[2 * i + 1]) ||
+          sscanf(s + 2 * i, "%2hhx", &hash[i]) != 1) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+  if (n != 32) {
+    return 1;
+  }
+  uint64_t bits = 0;
+  int32_t nbits = 0, k = 0;
+  for (int32_t i = 0; i < n; ++i) {
+    char c = toupper(s[i]);
+    if (c >= 'A' && c <= 'Z') {
+      bits = bits << 5 | (c - 'A');
+    } else if (c >= '2' && c <= '7') {
+      bits = bits << 5 | (c - '2' + 26);
+    } else {
+      return 1;
+    }
+    if ((nbits += 5) >= 8) {
+      nbits -= 8;
+      hash[k++] = bits >> nbits;
+    }
+  }
+  return 0;
+}
+
+// Parse magnet:?xt=urn:btih:<hash>&tr=<url>&x.pe=<ip:port>... Other
+// parameters, and peer addresses other than IPv4 ones, are ignored.
+int32_t magnet_parse(magnet_t *m, char *uri) {
+  memset(m, 0, sizeof(magnet_t));
+  if (strncmp(uri, "magnet:?", 8) != 0) {
+    fprintf(stderr, "Not a magnet link\n");
+    return 1;
+  }
+  // neither list can outgrow the link
+  int32_t len = strlen(uri);
+  m->announce_list = (char *)malloc(2 * len + 2);
+  m->peers = (uint8_t *)malloc(len * PEER_INFO_SIZE);
+  if (m->announce_list == NULL || m->peers == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    magnet_free(m);
+    return 1;
+  }
+  char *list = m->announce_list;
+  *list++ = 'l';
+  bool hash = false;
+  for (char *s = uri + 8; *s != '\0';) {
+    char *end = strchrnul(s, '&');
+    char *eq = memchr(s, '=', end - s);
+    if (eq != NULL) {
+      int32_t klen = eq - s;
+      char value[end - eq];
+      int32_t n = url_unescape(eq + 1, end - eq - 1, value);
+      value[n] = '\0';
+      if (klen == 2 && memcmp(s, "xt", 2) == 0 &&
+          strncmp(value, "urn:btih:", 9) == 0) {
+        hash = parse_btih(value + 9, n - 9, m->info_hash) == 0;
+      } else if (klen >= 2 && memcmp(s, "tr", 2) == 0 &&
+                 (klen == 2 || s[2] == '.') && n != 0) {
+        list += sprintf(list, "l%d:", n);
+        memcpy(list, value, n);
+        list += n;
+        *list++ = 'e';
+      } else if (klen == 4 && memcmp(s, "x.pe", 4) == 0) {
+        char *port = strrchr(value, ':');
+        uint8_t *info = m->peers + m->npeers * PEER_INFO_SIZE;
+        if (port != NULL) {
+          *port++ = '\0';
+          long p = strtol(port, NULL, 10);
+          if (inet_pton(AF_INET, value, info) == 1 && p > 0 && p < 65536) {
+            *(uint16_t *)(info + 4) = htons(p);
+            ++m->npeers;
+          }
+        }
+      }
+    }
+    s = *end != '\0' ? end + 1 : end;
+  }
+  *list++ = 'e';
+  m->announce_len = list - m->announce_list;
+  if (m->announce_len == 2) {
+    free(m->announce_list);
+    m->announce_list = NULL;
+  }
+  if (!hash) {
+    fprintf(stderr, "Magnet link has no BitTorrent info hash\n");
+    magnet_free(m);
+    return 1;
+  }
+  if (m->announce_list == NULL && m->npeers == 0) {
+    fprintf(stderr, "Magnet link names no tracker or peer\n");
+    magnet_free(m);
+    return 1;
+  }
+  return 0;
+}
+
+typedef enum {
+  FETCH_CONNECTING,
+  FETCH_HANDSHAKE,
+  FETCH_MESSAGES,
+  FETCH_CLOSED
+} fetchstate_t;
+
+// A connection the info dict is fetched over.
+typedef struct {
+  int32_t fd;
+  fetchstate_t state;
+  uint8_t ut_metadata; // its id for ut_metadata messages, 0 until it says
+  int32_t piece;       // of the info dict, asked of it, or -1
+  int64_t size;        // of the info dict as it says, 0 if it did not
+  int64_t deadline_us;
+  uint8_t *in; // received and not decoded yet
+  uint32_t in_len;
+} fetchpeer_t;
+
+// Fetches the info dict of a magnet link from peers that speak ut_metadata
+// (BEP 9). Every connected peer is asked for a piece of it at once, and
+// when each piece has been asked for, idle peers are asked for those still
+// outstanding too, so the whole dict takes a few round trips however many
+// pieces it has and however slow some peers are.
+typedef struct {
+  uint8_t info_hash[SHA_DIGEST_LENGTH];
+  uint8_t peer_id[20];
+  int32_t epfd;
+  uint8_t *addrs; // compact ip:port of every peer heard of
+  int32_t naddrs;
+  int32_t next; // the next of them to dial
+  fetchpeer_t *peers; // MAX_CONNECTING of them
+  int32_t live;
+  uint8_t *metadata;
+  int64_t size;        // of the info dict, 0 until a peer tells
+  fetchpeer_t *sizer;  // the peer size was taken from, while connected
+  uint8_t *pieces;     // 0 missing, 1 asked for, 2 in
+  uint32_t npieces;
+  uint32_t ndone;
+} fetch_t;
+
+// the largest message a peer may send while we fetch: a metadata piece, or
+// the bitfield of the largest info dict we accept
+const uint32_t MAX_FETCH_MESSAGE = 1 << 17;
+const uint32_t FETCH_BUFFER = 4 + MAX_FETCH_MESSAGE + RECV_BUFFER;
+
+int32_t fetch_init(fetch_t *f, uint8_t *info_hash) {
+  memset(f, 0, sizeof(fetch_t));
+  f->epfd = -1;
+  f->peers = (fetchpeer_t *)calloc(MAX_CONNECTING, sizeof(fetchpeer_t));
+  if (f->peers == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  for (int32_t i = 0; i < MAX_CONNECTING; ++i) {
+    f->peers[i].state = FETCH_CLOSED;
+  }
+  memcpy(f->info_hash, info_hash, SHA_DIGEST_LENGTH);
+  RAND_bytes(f->peer_id, 20);
+  f->addrs = (uint8_t *)malloc(MAX_CANDIDATES * PEER_INFO_SIZE);
+  if (f->addrs == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  for (int32_t i = 0; i < MAX_CONNECTING; ++i) {
+    f->peers[i].in = (uint8_t *)malloc(FETCH_BUFFER);
+    if (f->peers[i].in == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      return 1;
+    }
+  }
+  if ((f->epfd = epoll_create1(0)) < 0) {
+    perror("Failed to create epoll instance");
+    return 1;
+  }
+  return 0;
+}
+
+void fetch_add_peer(void *ctx, uint8_t *info) {
+  fetch_t *f = (fetch_t *)ctx;
+  for (int32_t i = 0; i < f->naddrs; ++i) {
+    if (memcmp(f->addrs + i * PEER_INFO_SIZE, info, PEER_INFO_SIZE) == 0) {
+      return;
+    }
+  }
+  if (f->naddrs < (int32_t)MAX_CANDIDATES) {
+    memcpy(f->addrs + f->naddrs++ * PEER_INFO_SIZE, info, PEER_INFO_SIZE);
+  }
+}
+
+void fetch_close(fetch_t *f, fetchpeer_t *p) {
+  if (p->state == FETCH_CLOSED) {
+    return;
+  }
+  close(p->fd);
+  p->state = FETCH_CLOSED;
+  if (p->piece >= 0 && f->pieces[p->piece] == 1) {
+    f->pieces[p->piece] = 0;
+  }
+  if (f->sizer == p) {
+    f->sizer = NULL;
+  }
+  --f->live;
+}
+
+// Dial the peers heard of in turn, while connections are free.
+void fetch_dial(fetch_t *f) {
+  for (int32_t i = 0; i < MAX_CONNECTING && f->next < f->naddrs; ++i) {
+    fetchpeer_t *p = &f->peers[i];
+    if (p->state != FETCH_CLOSED) {
+      continue;
+    }
+    uint8_t *info = f->addrs + f->next++ * PEER_INFO_SIZE;
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = *(uint16_t *)(info + 4);
+    addr.sin_addr.s_addr = *(uint32_t *)info;
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = p};
+    p->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (p->fd < 0 ||
+        (connect(p->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 &&
+         errno != EINPROGRESS) ||
+        epoll_ctl(f->epfd, EPOLL_CTL_ADD, p->fd, &ev) != 0) {
+      if (p->fd >= 0) {
+        close(p->fd);
+      }
+      continue;
+    }
+    p->state = FETCH_CONNECTING;
+    p->ut_metadata = 0;
+    p->piece = -1;
+    p->size = 0;
+    p->in_len = 0;
+    p->deadline_us = now_us() + CONNECT_TIMEOUT * 1000000LL;
+    ++f->live;
+  }
+}
+
+// Send a message whole. Nothing sent here is more than a few hundred
+// bytes, which a connection's send buffer always has room for, so a short
+// write means the connection is gone.
+int32_t fetch_send(fetchpeer_t *p, uint8_t *msg, uint32_t n) {
+  return send(p->fd, msg, n, MSG_NOSIGNAL) == (ssize_t)n ? 0 : 1;
+}
+
+// Take the size of the info dict from a peer that tells it.
+int32_t fetch_set_size(fetch_t *f, fetchpeer_t *p) {
+  f->npieces = (p->size + METADATA_PIECE - 1) / METADATA_PIECE;
+  f->metadata = (uint8_t *)malloc(p->size);
+  f->pieces = (uint8_t *)calloc(f->npieces, 1);
+  if (f->metadata == NULL || f->pieces == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  f->size = p->size;
+  f->sizer = p;
+  return 0;
+}
+
+// Ask an idle peer for a piece of the info dict that nobody has been asked
+// for yet, or failing that, one that is still outstanding.
+int32_t fetch_request(fetch_t *f, fetchpeer_t *p) {
+  if (f->size == 0 && p->size != 0 && fetch_set_size(f, p) != 0) {
+    return 1;
+  }
+  // one that tells another size would not send the same info dict
+  if (f->size == 0 || p->ut_metadata == 0 || p->piece >= 0 ||
+      (p->size != 0 && p->size != f->size)) {
+    return 0;
+  }
+  for (uint8_t want = 0; want < 2 && p->piece < 0; ++want) {
+    for (uint32_t i = 0; i < f->npieces && p->piece < 0; ++i) {
+      if (f->pieces[i] == want) {
+        p->piece = i;
+      }
+    }
+  }
+  if (p->piece < 0) {
+    return 0;
+  }
+  f->pieces[p->piece] = 1;
+  uint8_t msg[80];
+  return fetch_send(p, msg,
+                    build_metadata_message(msg, p->ut_metadata, 0, p->piece,
+                                           0, 0));
+}
+
+// An extension protocol message: the peer's handshake, a piece of the info
+// dict or its refusal to send one. Returns 1 to drop the peer, which it is
+// if it cannot give us the info dict.
+int32_t fetch_on_extended(fetch_t *f, fetchpeer_t *p, uint8_t *msg,
+                          uint32_t n) {
+  if (n < 2) {
+    return 1;
+  }
+  char *s = (char *)msg + 2;
+  char *end = (char *)msg + n;
+  bedoc_t doc;
+  if (be_parse(s, end - s, &doc) != 0) {
+    return 1;
+  }
+  // a piece of the info dict follows the dict of a data message
+  be_scan(&s, end, NULL, 0);
+  int32_t ret = 0;
+  bevalue_t *v = &doc.root;
+  int64_t id = 0, size = 0, type = 0, piece = -1;
+  if (v->type != BE_VEC || !v->val.vec.is_dict) {
+    ret = 1;
+  } else if (msg[1] == 0) {
+    bevalue_t *m = bevec_dict_get(&v->val.vec, "m");
+    if (m == NULL || m->type != BE_VEC ||
+        !be_dict_int(&m->val.vec, "ut_metadata", &id) || id <= 0 ||
+        id > 255) {
+      ret = 1;
+    } else {
+      p->ut_metadata = id;
+      if (be_dict_int(&v->val.vec, "metadata_size", &size) && size > 0 &&
+          size <= MAX_METADATA) {
+        p->size = size;
+      }
+    }
+  } else if (msg[1] == UT_METADATA_ID &&
+             be_dict_int(&v->val.vec, "msg_type", &type) &&
+             be_dict_int(&v->val.vec, "piece", &piece) && p->piece >= 0 &&
+             piece == p->piece) {
+    p->piece = -1;
+    int64_t begin = piece * METADATA_PIECE;
+    int64_t len = min64(f->size - begin, METADATA_PIECE);
+    if (f->size == 0 || piece >= f->npieces) {
+      // asked for at a size that has since been dropped
+    } else if (type != 1 || end - s != len) {
+      // it does not have the info dict, or sends something else
+      f->pieces[piece] = f->pieces[piece] == 2 ? 2 : 0;
+      ret = 1;
+    } else if (f->pieces[piece] != 2) {
+      memcpy(f->metadata + begin, s, len);
+      f->pieces[piece] = 2;
+      ++f->ndone;
+    }
+  }
+  bedoc_free(&doc);
+  return ret;
+}
+
+// Read what the socket has and decode every complete message, keeping
+// what is left of the last one for the next read.
+int32_t fetch_on_readable(fetch_t *f, fetchpeer_t *p) {
+  ssize_t n = recv(p->fd, p->in + p->in_len, FETCH_BUFFER - p->in_len, 0);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+  if (n <= 0) {
+    return 1;
+  }
+  p->deadline_us = now_us() + CONNECT_TIMEOUT * 1000000LL;
+  p->in_len += n;
+
+  uint8_t *s = p->in;
+  uint8_t *end = p->in + p->in_len;
+  if (p->state == FETCH_HANDSHAKE) {
+    if (end - s < 68) {
+      return 0;
+    }
+    // of no use unless it speaks the extension protocol
+    if (s[0] != 19 || memcmp(s + 28, f->info_hash, SHA_DIGEST_LENGTH) != 0 ||
+        memcmp(s + 48, f->peer_id, 20) == 0 || (s[25] & 0x10) == 0) {
+      return 1;
+    }
+    p->state = FETCH_MESSAGES;
+    s += 68;
+  }
+  while (end - s >= 4) {
+    uint32_t len = ntohl(*(uint32_t *)s);
+    if (len > MAX_FETCH_MESSAGE) {
+      return 1;
+    }
+    if ((uint32_t)(end - s - 4) < len) {
+      break;
+    }
+    // all but extension messages are of no interest
+    if (len != 0 && s[4] == 20 && fetch_on_extended(f, p, s + 4, len) != 0) {
+      return 1;
+    }
+    s += 4 + len;
+  }
+  p->in_len = end - s;
+  memmove(p->in, s, p->in_len);
+  return 0;
+}
+
+// Greet a peer once connected: our handshake and our extension handshake
+// in one write, since we have nothing to say to one that does not speak
+// the extension protocol anyway.
+int32_t fetch_on_event(fetch_t *f, fetchpeer_t *p, uint32_t events) {
+  if (p->state != FETCH_CONNECTING) {
+    return fetch_on_readable(f, p);
+  }
+  int32_t err = 0;
+  socklen_t len = sizeof(err);
+  if ((events & (EPOLLERR | EPOLLHUP)) != 0 ||
+      getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+    return 1;
+  }
+  uint8_t msg[68 + 64];
+  build_handshake(msg, f->info_hash, f->peer_id);
+  uint32_t n = 68 + build_extended_handshake(msg + 68, 0);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = p};
+  if (fetch_send(p, msg, n) != 0 ||
+      epoll_ctl(f->epfd, EPOLL_CTL_MOD, p->fd, &ev) != 0) {
+    return 1;
+  }
+  p->state = FETCH_HANDSHAKE;
+  p->deadline_us = now_us() + CONNECT_TIMEOUT * 1000000LL;
+  return 0;
+}
+
+// Whether the info dict is all in. One that does not match the info hash
+// is thrown away, along with its size, and fetched again at the size the
+// next peer tells. The peer the size came from is dropped, as it may have
+// told a wrong one that no refetch could ever match.
+bool fetch_done(fetch_t *f) {
+  if (f->size == 0 || f->ndone != f->npieces) {
+    return false;
+  }
+  uint8_t md[SHA_DIGEST_LENGTH];
+  SHA1(f->metadata, f->size, md);
+  if (memcmp(md, f->info_hash, SHA_DIGEST_LENGTH) == 0) {
+    return true;
+  }
+  fprintf(stderr, "Info dict does not match the info hash, fetching again\n");
+  for (int32_t i = 0; i < MAX_CONNECTING; ++i) {
+    f->peers[i].piece = -1;
+  }
+  if (f->sizer != NULL) {
+    fetch_close(f, f->sizer);
+  }
+  free(f->metadata);
+  free(f->pieces);
+  f->metadata = NULL;
+  f->pieces = NULL;
+  f->size = 0;
+  f->npieces = 0;
+  f->ndone = 0;
+  return false;
+}
+
+// Fetch the info dict, dialing the peers tr names as they come in. Returns
+// 1 if it runs out of peers before it has the dict.
+int32_t fetch_run(fetch_t *f, tracker_t *tr) {
+  struct epoll_event tev = {.events = EPOLLIN, .data.ptr = tr};
+  if (epoll_ctl(f->epfd, EPOLL_CTL_ADD, tr->epfd, &tev) != 0) {
+    perror("Failed to register tracker");
+    return 1;
+  }
+  tracker_poll(tr);
+  fetch_dial(f);
+  while (!fetch_done(f)) {
+    if (f->live == 0 && !tr->running && f->next == f->naddrs) {
+      fprintf(stderr, "No peer sent the info dict\n");
+      return 1;
+    }
+    struct epoll_event events[32];
+    int32_t n = epoll_wait(f->epfd, events, 32, tracker_timeout(tr, 250));
+    if (n < 0 && errno != EINTR) {
+      perror("Failed to wait for events");
+      return 1;
+    }
+    for (int32_t i = 0; i < n; ++i) {
+      fetchpeer_t *p = (fetchpeer_t *)events[i].data.ptr;
+      if (events[i].data.ptr != tr && p->state != FETCH_CLOSED &&
+          fetch_on_event(f, p, events[i].events) != 0) {
+        fetch_close(f, p);
+      }
+    }
+    tracker_poll(tr);
+    fetch_dial(f);
+
+    int64_t now = now_us();
+    for (int32_t i = 0; i < MAX_CONNECTING; ++i) {
+      fetchpeer_t *p = &f->peers[i];
+      if (p->state != FETCH_CLOSED &&
+          (now > p->deadline_us || fetch_request(f, p) != 0)) {
+        fetch_close(f, p);
+      }
+    }
+  }
+  return 0;
+}
+
+void fetch_free(fetch_t *f) {
+  for (int32_t i = 0; f->peers != NULL && i < MAX_CONNECTING; ++i) {
+    fetch_close(f, &f->peers[i]);
+    free(f->peers[i].in);
+  }
+  free(f->peers);
+  if (f->epfd >= 0) {
+    close(f->epfd);
+  }
+  free(f->addrs);
+  free(f->metadata);
+  free(f->pieces);
+}
+
+// Open the torrent of a magnet link: fetch its info dict from the swarm and
+// decode it as a .torrent that has the link's trackers. tr is started for
+// the fetch and left announcing for the download, and the addresses of the
+// peers heard of so far go to peers, for the download to dial right away.
+int32_t magnet_open(torrent_t *t, tracker_t *tr, char *uri, uint16_t port,
+                    uint8_t **peers, int32_t *npeers) {
+  magnet_t m;
+  if (magnet_parse(&m, uri) != 0) {
+    return 1;
+  }
+  // all the trackers need to know is the info hash and the tiers
+  torrent_t stub = {.announce = {.str = "", .n = 0}};
+  memcpy(stub.info_hash, m.info_hash, SHA_DIGEST_LENGTH);
+  bedoc_t doc = {.arena = NULL};
+  if (m.announce_list != NULL) {
+    if (be_parse(m.announce_list, m.announce_len, &doc) != 0) {
+      magnet_free(&m);
+      return 1;
+    }
+    stub.announce_list = &doc.root.val.vec;
+  }
+
+  fetch_t f;
+  if (fetch_init(&f, m.info_hash) != 0) {
+    fetch_free(&f);
+    bedoc_free(&doc);
+    magnet_free(&m);
+    return 1;
+  }
+  for (int32_t i = 0; i < m.npeers; ++i) {
+    fetch_add_peer(&f, m.peers + i * PEER_INFO_SIZE);
+  }
+  // how much is left is not known yet, anything but 0 makes us a leecher
+  int32_t ret = tracker_start(tr, &stub, port, 1, fetch_add_peer, &f);
+  if (ret == 0) {
+    ret = fetch_run(&f, tr);
   }
 
-  free(buf);
-  bevalue_free(&v);
-  return 0;
+  if (ret == 0) {
+    // d 13:announce-list <list> 4:info <info dict> e
+    int64_t list_len = m.announce_list != NULL ? 16 + m.announce_len : 0;
+    t->size = 1 + list_len + 6 + f.size + 1;
+    t->buf = (char *)mmap(NULL, t->size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (t->buf == MAP_FAILED) {
+      perror("Failed to map torrent");
+      ret = 1;
+    } else {
+      char *s = t->buf;
+      *s++ = 'd';
+      if (m.announce_list != NULL) {
+        s += sprintf(s, "13:announce-list");
+        memcpy(s, m.announce_list, m.announce_len);
+        s += m.announce_len;
+      }
+      memcpy(s, "4:info", 6);
+      memcpy(s + 6, f.metadata, f.size);
+      s[6 + f.size] = 'e';
+      ret = torrent_decode(t);
+    }
+  }
+  if (ret != 0) {
+    tracker_free(tr);
+  } else {
+    *peers = f.addrs;
+    *npeers = f.naddrs;
+    f.addrs = NULL;
+  }
+  fetch_free(&f);
+  bedoc_free(&doc);
+  magnet_free(&m);
+  return ret;
 }
 
-int32_t perform_get_request(char *bencode_buf, bestring_t *res) {
-  char *s = bencode_buf;
-  bevalue_t v;
-  assert(next_value(&s, &v) == 0);
+typedef struct {
+  char *outfile;
+  bool use_mmap;
+  char *priorities;      // download only, <file>=<priority>,...
+  char *metrics;         // download and seed, file to append metrics to
+  uint16_t port;         // download and seed, where peers can reach us
+  bool nagle;            // download and seed, see swarm_t
+  bool zerocopy;         // download and seed, see swarm_t
+  char *announce;        // create only
+  uint32_t piece_length; // create only, 0 to pick one
+} options_t;
 
-  bevalue_t *announce_v = bevec_dict_get(&v.val.vec, "announce");
-  assert(announce_v != NULL && announce_v->type == BE_STR);
-  bevalue_t *info_v = bevec_dict_get(&v.val.vec, "info");
-  assert(info_v != NULL && info_v->type == BE_VEC && info_v->val.vec.is_dict);
-  bevalue_t *length_v = bevec_dict_get(&info_v->val.vec, "length");
-  assert(length_v != NULL || length_v->type == BE_INT);
+// Parse a list like 0=2,3=0 into per-file priorities, all others normal.
+int32_t parse_priorities(char *spec, uint8_t *prio, int32_t nfiles) {
+  for (int32_t i = 0; i < nfiles; ++i) {
+    prio[i] = PRIORITY_NORMAL;
+  }
+  for (char *s = spec; s != NULL && *s != '\0';) {
+    char *end;
+    long file = strtol(s, &end, 10);
+    if (end == s || *end != '=' || file < 0 || file >= nfiles) {
+      fprintf(stderr, "Invalid file in priority list: %s\n", s);
+      return 1;
+    }
+    s = end + 1;
+    long level = strtol(s, &end, 10);
+    if (end == s || (*end != ',' && *end != '\0') || level < 0 ||
+        level > PRIORITY_HIGH) {
+      fprintf(stderr, "Priorities range from 0 (skip) to %d\n", PRIORITY_HIGH);
+      return 1;
+    }
+    prio[file] = level;
+    s = *end == ',' ? end + 1 : end;
+  }
+  return 0;
+}
 
-  s = bencode_buf;
-  char *raw_info_v = dict_get_raw(&s, "info");
-  assert(raw_info_v != NULL);
-  bevalue_t v2;
-  assert(next_value(&s, &v2) == 0);
-  bevalue_free(&v2);
+int32_t download(options_t *opts, char *filename, char *piece_index) {
+  torrent_t t;
+  if (torrent_open(&t, filename) != 0) {
+    return 1;
+  }
 
-  int32_t n = s - raw_info_v;
-  uint8_t hash[SHA_DIGEST_LENGTH];
-  SHA1((uint8_t *)raw_info_v, n, (uint8_t *)hash);
+  // however far the setup gets, what it set up is torn down at out
+  swarm_t sw;
+  tracker_t tr;
+  bool announcing = false;
+  int32_t ret = 1;
+  storage_init(&sw.storage, opts->use_mmap);
+  if (swarm_init(&sw, &t) != 0 ||
+      swarm_open_metrics(&sw, opts->metrics) != 0) {
+    goto out;
+  }
+  uint32_t index = atoi(piece_index);
+  if (index >= sw.sched.npieces) {
+    fprintf(stderr, "Piece index out of range\n");
+    goto out;
+  }
+  scheduler_want(&sw.sched, index, PRIORITY_NORMAL);
+  // the output holds just this piece
+  if (storage_add(&sw.storage, opts->outfile,
+                  (int64_t)index * sw.piece_length,
+                  piece_size(sw.total_length, sw.piece_length, index),
+                  false) != 0) {
+    goto out;
+  }
+  announcing = true;
+  if (tracker_start(&tr, &t, DEFAULT_PORT, t.total_length, swarm_add_peer,
+                    &sw) != 0) {
+    goto out;
+  }
 
-  CURL *handle = curl_easy_init();
-  assert(handle != NULL);
+  ret = swarm_run(&sw, &tr);
 
-  uint8_t id[20];
-  char url_buf[1024], enc_id[100], enc_hash[100];
-  assert(RAND_bytes(id, 20) == 1);
-  urlencode(hash, SHA_DIGEST_LENGTH, enc_hash);
-  urlencode(id, 20, enc_id);
-  uint32_t url_size = announce_v->val.str.n;
-  char *url = announce_v->val.str.str;
-  int64_t length = length_v->val.i;
-  sprintf(url_buf,
-          "%.*s?info_hash=%s&peer_id=%s&port=6881&uploaded=0&downloaded=0&"
-          "left=%ld&compact=1",
-          url_size, url, enc_hash, enc_id, length);
-  curl_easy_setopt(handle, CURLOPT_URL, url_buf);
-  curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_data);
-  curl_easy_setopt(handle, CURLOPT_WRITEDATA, res);
-
-  assert(curl_easy_perform(handle) == CURLE_OK);
-  curl_easy_cleanup(handle);
-  bevalue_free(&v);
-  return 0;
-}
-
-int32_t perform_handshake(int32_t sockfd, char *bencode_buf,
-                          uint8_t *data_buf) {
-  char *s = bencode_buf;
-
-  char *raw_info_v = dict_get_raw(&s, "info");
-  assert(raw_info_v != NULL);
-  bevalue_t v2;
-  assert(next_value(&s, &v2) == 0);
-  bevalue_free(&v2);
-  int32_t len = s - raw_info_v;
-  uint8_t hash[SHA_DIGEST_LENGTH];
-  SHA1((uint8_t *)raw_info_v, len, (uint8_t *)hash);
+out:
+  if (sw.metrics.out != NULL) {
+    fclose(sw.metrics.out);
+  }
+  storage_close(&sw.storage);
+  scheduler_free(&sw.sched);
+  if (announcing) {
+    tracker_free(&tr);
+  }
+  torrent_close(&t);
+  return ret;
+}
 
-  uint8_t id[20];
-  RAND_bytes(id, 20);
+int32_t download_everything(options_t *opts, char *filename) {
+  torrent_t t;
+  tracker_t tr;
+  uint8_t *known = NULL;
+  int32_t nknown = 0;
+  // the trackers of a magnet link are announced to from the start, to find
+  // the peers its info dict comes from
+  bool magnet = strncmp(filename, "magnet:", 7) == 0;
+  if (magnet ? magnet_open(&t, &tr, filename, opts->port, &known, &nknown) != 0
+             : torrent_open(&t, filename) != 0) {
+    return 1;
+  }
 
-  uint32_t n = 0;
+  // however far the setup gets, what it set up is torn down at out
+  uint8_t file_prio[t.nfiles];
+  char *paths[t.nfiles];
+  char resume_path[strlen(opts->outfile) + sizeof(".resume")];
+  swarm_t sw;
+  resume_t resume;
+  bool announcing = magnet;
+  bool resuming = false;
+  int32_t ret = 1;
+  storage_init(&sw.storage, opts->use_mmap);
+  int32_t ok = swarm_init(&sw, &t);
+  sw.port = opts->port;
+  sw.nagle = opts->nagle;
+  sw.zerocopy = opts->zerocopy;
+  sw.known = known;
+  sw.nknown = nknown;
+  if (ok != 0 || parse_priorities(opts->priorities, file_prio, t.nfiles) != 0 ||
+      swarm_open_metrics(&sw, opts->metrics) != 0 ||
+      swarm_open_files(&sw, &t, opts->outfile, file_prio, paths) != 0) {
+    goto out;
+  }
 
-  // perform handshake
-  data_buf[0] = 19;
-  memcpy(data_buf + 1, "BitTorrent protocol", 19);
-  memset(data_buf + 20, 0, 8);
-  memcpy(data_buf + 28, hash, 20);
-  memcpy(data_buf + 48, id, 20);
-  assert(send(sockfd, data_buf, 68, 0) == 68);
+  // pick up where an earlier run left off
+  bool trusted;
+  sprintf(resume_path, "%s.resume", opts->outfile);
+  if (resume_open(&resume, resume_path, sw.info_hash, sw.sched.npieces, paths,
+                  t.nfiles, &trusted) != 0) {
+    goto out;
+  }
+  resuming = true;
+  if (swarm_load_resume(&sw, &resume, trusted) != 0) {
+    goto out;
+  }
+
+  // a piece is as important as the most important file it overlaps
+  uint8_t *piece_prio = (uint8_t *)calloc(sw.sched.npieces, sizeof(uint8_t));
+  if (piece_prio == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    goto out;
+  }
+  for (int32_t i = 0; i < t.nfiles; ++i) {
+    torrent_file_t *f = &t.files[i];
+    for (int64_t k = f->offset / sw.piece_length;
+         f->length != 0 && k <= (f->offset + f->length - 1) / sw.piece_length;
+         ++k) {
+      piece_prio[k] = piece_prio[k] > file_prio[i] ? piece_prio[k]
+                                                   : file_prio[i];
+    }
+  }
+  for (uint32_t i = 0; i < sw.sched.npieces; ++i) {
+    if (piece_prio[i] != 0) {
+      scheduler_want(&sw.sched, i, piece_prio[i]);
+    }
+  }
+  free(piece_prio);
+  if (resume_begin(&resume) != 0) {
+    goto out;
+  }
+  sw.resume = &resume;
+  if (magnet) {
+    tr.on_peer = swarm_add_peer;
+    tr.ctx = &sw;
+    tr.left = swarm_left(&sw);
+  } else {
+    announcing = true;
+    if (tracker_start(&tr, &t, sw.port, swarm_left(&sw), swarm_add_peer,
+                      &sw) != 0) {
+      goto out;
+    }
+  }
 
-  // receive handshake
-  assert(recv(sockfd, data_buf, 1, 0) == 1);
-  assert((n = recv(sockfd, data_buf + 1, data_buf[0] + 48, 0)) ==
-         data_buf[0] + 48); // remaining 48 and additional 4 if bitfield is sent
+  signal(SIGINT, on_interrupt);
+  signal(SIGTERM, on_interrupt);
+  ret = swarm_run(&sw, &tr);
+  resume_close(&resume, paths);
+  resuming = false;
 
-  return 0;
+out:
+  if (resuming) {
+    resume_free(&resume);
+  }
+  if (sw.metrics.out != NULL) {
+    fclose(sw.metrics.out);
+  }
+  storage_close(&sw.storage);
+  scheduler_free(&sw.sched);
+  if (announcing) {
+    tracker_free(&tr);
+  }
+  torrent_close(&t);
+  free(known);
+  return ret;
 }
 
-int32_t discover(char *filename) {
-  char *buf = read_file(filename);
-  if (buf == NULL) {
-    fprintf(stderr, "Failed to read file\n");
+// Serve a complete copy of the torrent's data until interrupted. The
+// pieces recorded in the resume file beside it are trusted if the data is
+// untouched since, otherwise every piece is hashed first; running recheck
+// beforehand does that on all cores.
+int32_t seed(options_t *opts, char *filename, char *datafile) {
+  torrent_t t;
+  if (torrent_open(&t, filename) != 0) {
     return 1;
   }
 
-  bestring_t res = {.str = (char *)malloc(0), .n = 0};
-  assert(perform_get_request(buf, &res) == 0);
-  bevalue_t res_v;
-  char *s = res.str;
-  assert(next_value(&s, &res_v) == 0);
+  // however far the setup gets, what it set up is torn down at out
+  char *paths[t.nfiles];
+  char resume_path[strlen(datafile) + sizeof(".resume")];
+  swarm_t sw;
+  tracker_t tr;
+  resume_t resume;
+  bool announcing = false;
+  bool resuming = false;
+  int32_t ret = 1;
+  storage_init(&sw.storage, opts->use_mmap);
+  sw.storage.read_only = true;
+  int32_t ok = swarm_init(&sw, &t);
+  sw.port = opts->port;
+  sw.nagle = opts->nagle;
+  sw.zerocopy = opts->zerocopy;
+  sw.seeding = true;
+  if (ok != 0 || swarm_open_metrics(&sw, opts->metrics) != 0 ||
+      swarm_open_files(&sw, &t, datafile, NULL, paths) != 0) {
+    goto out;
+  }
+
+  bool trusted;
+  sprintf(resume_path, "%s.resume", datafile);
+  if (resume_open(&resume, resume_path, sw.info_hash, sw.sched.npieces, paths,
+                  t.nfiles, &trusted) != 0) {
+    goto out;
+  }
+  resuming = true;
+  if (!trusted) {
+    memset(resume.bitmap, 0xff, (sw.sched.npieces + 7) / 8);
+  }
+  if (swarm_load_resume(&sw, &resume, trusted) != 0) {
+    goto out;
+  }
+  if (resume_begin(&resume) != 0) {
+    goto out;
+  }
+  printf("Seeding %d of %d pieces on port %d\n", sw.sched.done,
+         sw.sched.npieces, sw.port);
+  fflush(stdout);
+  announcing = true;
+  if (tracker_start(&tr, &t, sw.port, swarm_left(&sw), swarm_add_peer, &sw) !=
+      0) {
+    goto out;
+  }
+
+  signal(SIGINT, on_interrupt);
+  signal(SIGTERM, on_interrupt);
+  ret = swarm_run(&sw, &tr);
+  resume_close(&resume, paths);
+  resuming = false;
+
+out:
+  if (resuming) {
+    resume_free(&resume);
+  }
+  if (sw.metrics.out != NULL) {
+    fclose(sw.metrics.out);
+  }
+  storage_close(&sw.storage);
+  scheduler_free(&sw.sched);
+  if (announcing) {
+    tracker_free(&tr);
+  }
+  torrent_close(&t);
+  return ret;
+}
+
+// Shared state of the recheck workers. Pieces are handed out in batches
+// from an atomic cursor, so all threads move through the file together and
+// the reads stay close to sequential.
+typedef struct {
+  uint8_t *data;
+  int64_t size;
+  uint8_t *hashes;
+  uint64_t total_length;
+  uint32_t piece_length;
+  uint32_t npieces;
+  uint32_t batch;
+  uint32_t next;
+  uint8_t *ok; // one byte per piece, so workers never share a word
+} recheck_t;
+
+void *recheck_worker(void *arg) {
+  recheck_t *rc = (recheck_t *)arg;
+  int64_t page = sysconf(_SC_PAGESIZE);
+  for (;;) {
+    uint32_t first = __atomic_fetch_add(&rc->next, rc->batch, __ATOMIC_RELAXED);
+    if (first >= rc->npieces) {
+      return NULL;
+    }
+    uint32_t last = min(first + rc->batch, rc->npieces);
 
-  bevalue_t *peers_v = bevec_dict_get(&res_v.val.vec, "peers");
-  assert(peers_v != NULL && peers_v->type == BE_STR);
+    // ask for the batch after this one while we hash
+    int64_t ahead = (int64_t)last * rc->piece_length;
+    int64_t len = (int64_t)rc->batch * rc->piece_length;
+    if (ahead < rc->size) {
+      len = ahead + len > rc->size ? rc->size - ahead : len;
+      madvise(rc->data + ahead / page * page, len + ahead % page,
+              MADV_WILLNEED);
+    }
 
-  for (int32_t i = 0; i < peers_v->val.str.n; i += PEER_INFO_SIZE) {
-    print_ip((uint8_t *)(peers_v->val.str.str + i));
+    for (uint32_t i = first; i < last; ++i) {
+      int64_t offset = (int64_t)i * rc->piece_length;
+      uint32_t size = piece_size(rc->total_length, rc->piece_length, i);
+      rc->ok[i] = offset + size <= rc->size &&
+                  verify_piece(rc->data + offset, size,
+                               rc->hashes + i * SHA_DIGEST_LENGTH) == 0;
+    }
   }
+}
 
-  free(res.str);
-  free(buf);
-  bevalue_free(&res_v);
-  return 0;
+bool cpu_has_sha_ni(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t eax, ebx, ecx, edx;
+  return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx >> 29 & 1);
+#else
+  return false;
+#endif
 }
 
-int32_t handshake(char *filename, char *peer_info) {
-  char *buf = read_file(filename);
-  if (buf == NULL) {
-    fprintf(stderr, "Failed to read file\n");
+// Hash an existing copy of the torrent's data on every core and report
+// which pieces are intact. The result is written to the resume file so a
+// following download only fetches what is missing.
+int32_t recheck(char *filename, char *datafile) {
+  torrent_t t;
+  if (torrent_open(&t, filename) != 0) {
+    return 1;
+  }
+  if (t.multi_file) {
+    fprintf(stderr, "Recheck of multi-file torrents is not supported\n");
+    torrent_close(&t);
     return 1;
   }
 
-  char *ip = peer_info;
-  char *port = strchr(peer_info, ':');
-  assert(port != NULL);
-  *port++ = '\0';
+  recheck_t rc = {
+      .hashes = t.hashes,
+      .total_length = t.total_length,
+      .piece_length = t.piece_length,
+      .npieces = t.npieces,
+      .next = 0,
+  };
+  // batches of about HASH_BATCH bytes
+  rc.batch = max(HASH_BATCH / rc.piece_length, 1);
 
-  int32_t sockfd;
-  struct sockaddr_in addr;
-  assert((sockfd = socket(AF_INET, SOCK_STREAM, 0)) > 0);
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(atoi(port));
-  addr.sin_addr.s_addr = inet_addr(ip);
-  assert(connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  // however far it gets, what it set up is torn down at out
+  int32_t nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  nthreads = nthreads < 1 ? 1 : nthreads;
+  pthread_t threads[nthreads];
+  char resume_path[strlen(datafile) + sizeof(".resume")];
+  resume_t resume;
+  bool resuming = false;
+  int32_t ret = 1;
+  rc.data = NULL;
+  rc.ok = NULL;
+  int32_t fd = open(datafile, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror("Failed to open file");
+    goto out;
+  }
+  rc.size = st.st_size < (int64_t)rc.total_length ? st.st_size
+                                                  : (int64_t)rc.total_length;
+  if (rc.size > 0) {
+    rc.data = (uint8_t *)mmap(NULL, rc.size, PROT_READ, MAP_SHARED, fd, 0);
+    if (rc.data == MAP_FAILED) {
+      perror("Failed to map file");
+      rc.data = NULL;
+      goto out;
+    }
+    madvise(rc.data, rc.size, MADV_SEQUENTIAL);
+  }
+  rc.ok = (uint8_t *)calloc(rc.npieces, sizeof(uint8_t));
+  if (rc.ok == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    goto out;
+  }
 
-  uint8_t recv_buf[100] = {0};
-  uint8_t id[20] = {0};
-  perform_handshake(sockfd, buf, recv_buf);
-  memcpy(id, recv_buf + recv_buf[0] + 29, 20);
-  printf("Peer ID: ");
-  print_hex(id);
+  int64_t start = now_us();
+  int32_t started = 0;
+  for (; started < nthreads; ++started) {
+    if (pthread_create(&threads[started], NULL, recheck_worker, &rc) != 0) {
+      perror("Failed to start hashing thread");
+      break;
+    }
+  }
+  // the ones that did start still hash every piece between them
+  for (int32_t i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  if (started == 0) {
+    goto out;
+  }
+  nthreads = started;
+  int64_t elapsed = now_us() - start;
+  elapsed = elapsed < 1 ? 1 : elapsed;
 
-  free(buf);
-  return 0;
+  // record the result so the next download resumes from it
+  bool trusted;
+  sprintf(resume_path, "%s.resume", datafile);
+  if (resume_open(&resume, resume_path, t.info_hash, rc.npieces, &datafile, 1,
+                  &trusted) != 0) {
+    goto out;
+  }
+  resuming = true;
+  uint32_t complete = 0;
+  memset(resume.bitmap, 0, (rc.npieces + 7) / 8);
+  for (uint32_t i = 0; i < rc.npieces; ++i) {
+    if (rc.ok[i]) {
+      bitfield_set(resume.bitmap, i);
+      ++complete;
+    }
+  }
+  if (resume_begin(&resume) != 0) {
+    goto out;
+  }
+
+  printf("Pieces: %d/%d complete\n", complete, rc.npieces);
+  printf("Bitmap: ");
+  for (uint32_t i = 0; i < (rc.npieces + 7) / 8; ++i) {
+    printf("%02x", resume.bitmap[i]);
+  }
+  printf("\n");
+  printf("Throughput: %.1f MB/s (%ld bytes, %d threads, SHA-1 %s)\n",
+         rc.size / (double)elapsed, rc.size, nthreads,
+         cpu_has_sha_ni() ? "with SHA-NI" : "without SHA-NI");
+  resume_close(&resume, &datafile);
+  resuming = false;
+  ret = 0;
+
+out:
+  if (resuming) {
+    resume_free(&resume);
+  }
+  if (rc.data != NULL) {
+    munmap(rc.data, rc.size);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(rc.ok);
+  torrent_close(&t);
+  return ret;
 }
 
-int32_t download_piece(int32_t sockfd, uint8_t *buf, uint32_t index,
-                       uint32_t piece_size, uint8_t **piece) {
-  uint8_t *new_piece = (uint8_t *)malloc(piece_size * sizeof(uint8_t));
-  if (new_piece == NULL) {
-    fprintf(stderr, "Failed to allocate memory\n");
+void be_write_int(FILE *f, int64_t i) { fprintf(f, "i%lde", i); }
+
+void be_write_str(FILE *f, char *s, int64_t n) {
+  fprintf(f, "%ld:", n);
+  fwrite(s, 1, n, f);
+}
+
+void be_write_cstr(FILE *f, char *s) { be_write_str(f, s, strlen(s)); }
+
+typedef struct {
+  char *path; // on disk
+  char *rel;  // within the torrent, '/' separated
+  int64_t length;
+  int64_t offset; // of the file's first byte within the torrent's data
+  int32_t fd;
+} source_t;
+
+// Shared state of the create workers, which take batches of pieces from
+// an atomic cursor like the recheck workers do.
+typedef struct {
+  source_t *files;
+  int32_t nfiles;
+  int32_t cap;
+  int64_t total_length;
+  uint32_t piece_length;
+  uint32_t npieces;
+  uint32_t batch;
+  uint32_t next;
+  bool failed;
+  uint8_t *hashes;
+} create_t;
+
+int32_t cmp_names(const void *a, const void *b) {
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+// Collect the regular files under path in name order. Symbolic links to
+// directories are not followed, so the walk cannot loop.
+int32_t create_add(create_t *ct, char *path, char *rel) {
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISLNK(st.st_mode) && stat(path, &st) == 0 &&
+      S_ISDIR(st.st_mode)) {
+    return 0;
+  }
+  if (stat(path, &st) != 0) {
+    perror(path);
     return 1;
   }
-  *piece = new_piece;
-  int32_t n;
 
-  for (int32_t i = 0, piece_dld = 0; piece_dld != piece_size; ++i) {
-    // request block
-    uint32_t block_size = min(piece_size - piece_dld, 1 << 14);
-    *(uint32_t *)buf = htonl(13);
-    buf[4] = 6;
-    *(uint32_t *)(buf + 5) = htonl(index);
-    *(uint32_t *)(buf + 9) = htonl(i << 14);
-    *(uint32_t *)(buf + 13) = htonl(block_size);
-    assert(send(sockfd, buf, 17, 0) == 17);
+  if (S_ISREG(st.st_mode)) {
+    if (ct->nfiles == ct->cap) {
+      ct->cap = ct->cap == 0 ? 16 : 2 * ct->cap;
+      source_t *files =
+          (source_t *)realloc(ct->files, ct->cap * sizeof(source_t));
+      if (files == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+      }
+      ct->files = files;
+    }
+    source_t *f = &ct->files[ct->nfiles++];
+    f->path = strdup(path);
+    f->rel = rel != NULL ? strdup(rel) : NULL;
+    f->length = st.st_size;
+    f->offset = ct->total_length;
+    f->fd = open(path, O_RDONLY);
+    if (f->fd < 0) {
+      perror(path);
+      return 1;
+    }
+    posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    ct->total_length += st.st_size;
+    return 0;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return 0;
+  }
 
-    // receive block
-    assert(recv(sockfd, buf, 13, 0) == 13);
-    assert(buf[4] == 7);
-    n = ntohl(*(uint32_t *)buf) - 9;
-    for (int32_t block_dld = 0; block_dld != n;) {
-      block_dld += recv(sockfd, buf + 13 + block_dld, n - block_dld, 0);
-      assert(block_dld > 0);
-      printf("##### downloading: %d\n", block_dld);
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    perror(path);
+    return 1;
+  }
+  char **names = NULL;
+  int32_t n = 0, cap = 0;
+  int32_t ret = 0;
+  for (struct dirent *e; (e = readdir(dir)) != NULL;) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+      continue;
+    }
+    if (n == cap) {
+      cap = cap == 0 ? 16 : 2 * cap;
+      char **grown = (char **)realloc(names, cap * sizeof(char *));
+      if (grown == NULL) {
+        ret = 1;
+        break;
+      }
+      names = grown;
+    }
+    if ((names[n] = strdup(e->d_name)) == NULL) {
+      ret = 1;
+      break;
     }
-    memcpy(*piece + piece_dld, buf + 13, block_size);
-    piece_dld += block_size;
+    ++n;
+  }
+  closedir(dir);
+  if (ret != 0) {
+    fprintf(stderr, "Failed to allocate memory\n");
+  }
+  if (n > 0) {
+    qsort(names, n, sizeof(char *), cmp_names);
+  }
 
-    printf("%d\n", buf[4]);
-    uint32_t i = ntohl(*(uint32_t *)(buf + 5));
-    uint32_t b = ntohl(*(uint32_t *)(buf + 9));
-    printf("Index: %d\n", i);
-    printf("Begin: %d\n", b);
-    printf("Downloaded: %d\n", block_size);
+  for (int32_t i = 0; i < n; ++i) {
+    char child[strlen(path) + strlen(names[i]) + 2];
+    char child_rel[(rel != NULL ? strlen(rel) : 0) + strlen(names[i]) + 2];
+    sprintf(child, "%s/%s", path, names[i]);
+    if (rel != NULL) {
+      sprintf(child_rel, "%s/%s", rel, names[i]);
+    } else {
+      strcpy(child_rel, names[i]);
+    }
+    if (ret == 0 && create_add(ct, child, child_rel) != 0) {
+      ret = 1;
+    }
+    free(names[i]);
   }
-  return 0;
+  free(names);
+  return ret;
 }
 
-int32_t verify_piece(uint8_t *piece, uint32_t piece_size, uint8_t *hash) {
-  uint8_t md[20];
-  SHA1(piece, piece_size, md);
-  assert(memcmp(md, hash, 20) == 0);
-  return 0;
+// The file holding byte offset of the concatenated data.
+int32_t create_find(create_t *ct, int64_t offset) {
+  int32_t lo = 0, hi = ct->nfiles - 1;
+  while (lo < hi) {
+    int32_t mid = lo + (hi - lo + 1) / 2;
+    if (ct->files[mid].offset <= offset) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
 }
 
-int32_t save_piece(uint8_t *piece, uint32_t piece_size, char *filename) {
-  FILE *f = fopen(filename, "a");
-  if (f == NULL) {
-    perror("Failed to open file");
-    return 1;
+int32_t create_read(create_t *ct, int64_t offset, uint8_t *buf, uint32_t len) {
+  for (int32_t i = create_find(ct, offset); len > 0; ++i) {
+    source_t *f = &ct->files[i];
+    int64_t at = offset - f->offset;
+    int64_t k = f->length - at < len ? f->length - at : len;
+    for (int64_t got = 0; got < k;) {
+      ssize_t r = pread(f->fd, buf + got, k - got, at + got);
+      if (r <= 0) {
+        fprintf(stderr, "Failed to read %s\n", f->path);
+        return 1;
+      }
+      got += r;
+    }
+    buf += k;
+    offset += k;
+    len -= k;
   }
-  assert(fwrite(piece, sizeof(uint8_t), piece_size, f) == piece_size);
-  fclose(f);
   return 0;
 }
 
-int32_t download(char *outfile, char *filename, char *piece_index) {
-  char *buf = read_file(filename);
-  assert(buf != NULL);
-
-  bestring_t res = {.str = malloc(0), .n = 0};
-  assert(perform_get_request(buf, &res) == 0);
-  bevalue_t res_v;
-  char *s = res.str;
-  assert(next_value(&s, &res_v) == 0);
+// Ask the kernel to start reading a range of the data ahead of its use.
+void create_advise(create_t *ct, int64_t offset, int64_t len) {
+  if (offset >= ct->total_length) {
+    return;
+  }
+  for (int32_t i = create_find(ct, offset); i < ct->nfiles && len > 0; ++i) {
+    source_t *f = &ct->files[i];
+    int64_t at = offset - f->offset;
+    int64_t k = f->length - at < len ? f->length - at : len;
+    posix_fadvise(f->fd, at, k, POSIX_FADV_WILLNEED);
+    offset += k;
+    len -= k;
+  }
+}
 
-  bevalue_t *peers_v = bevec_dict_get(&res_v.val.vec, "peers");
-  assert(peers_v != NULL && peers_v->type == BE_STR);
+void *create_worker(void *arg) {
+  create_t *ct = (create_t *)arg;
+  uint8_t *buf = (uint8_t *)malloc(ct->piece_length);
+  if (buf == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    __atomic_store_n(&ct->failed, true, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  for (;;) {
+    uint32_t first = __atomic_fetch_add(&ct->next, ct->batch, __ATOMIC_RELAXED);
+    if (first >= ct->npieces ||
+        __atomic_load_n(&ct->failed, __ATOMIC_RELAXED)) {
+      break;
+    }
+    uint32_t last = min(first + ct->batch, ct->npieces);
 
-  uint8_t *ptr = (uint8_t *)peers_v->val.str.str;
+    // ask for the batch after this one while we hash
+    create_advise(ct, (int64_t)last * ct->piece_length,
+                  (int64_t)ct->batch * ct->piece_length);
 
-  int32_t sockfd;
-  struct sockaddr_in addr;
-  assert((sockfd = socket(AF_INET, SOCK_STREAM, 0)) > 0);
-  addr.sin_family = AF_INET;
-  addr.sin_port = *(uint16_t *)(ptr + 4);
-  addr.sin_addr.s_addr = *(uint32_t *)ptr;
-  assert(connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    for (uint32_t i = first; i < last; ++i) {
+      uint32_t size = piece_size(ct->total_length, ct->piece_length, i);
+      if (create_read(ct, (int64_t)i * ct->piece_length, buf, size) != 0) {
+        __atomic_store_n(&ct->failed, true, __ATOMIC_RELAXED);
+        break;
+      }
+      SHA1(buf, size, ct->hashes + i * SHA_DIGEST_LENGTH);
+    }
+  }
+  free(buf);
+  return NULL;
+}
 
-  uint8_t data_buf[20000] = {0};
-  uint32_t n = 0;
+// Pieces of at least a block, doubled until there are at most
+// CREATE_MAX_PIECES of them or they reach 16 MiB.
+uint32_t create_piece_length(int64_t total_length) {
+  uint32_t len = BLOCK_SIZE;
+  while (total_length / len >= CREATE_MAX_PIECES && len < (1 << 24)) {
+    len *= 2;
+  }
+  return len;
+}
 
-  assert(perform_handshake(sockfd, buf, data_buf) == 0);
+int32_t create_write(create_t *ct, char *outfile, char *announce, char *name,
+                     bool multi) {
+  FILE *f = fopen(outfile, "wb");
+  if (f == NULL) {
+    perror("Failed to create torrent file");
+    return 1;
+  }
+  // keys in sorted order, as bencode requires
+  fputc('d', f);
+  be_write_cstr(f, "announce");
+  be_write_cstr(f, announce);
+  be_write_cstr(f, "creation date");
+  be_write_int(f, time(NULL));
+  be_write_cstr(f, "info");
+  fputc('d', f);
+  if (multi) {
+    be_write_cstr(f, "files");
+    fputc('l', f);
+    for (int32_t i = 0; i < ct->nfiles; ++i) {
+      fputc('d', f);
+      be_write_cstr(f, "length");
+      be_write_int(f, ct->files[i].length);
+      be_write_cstr(f, "path");
+      fputc('l', f);
+      for (char *s = ct->files[i].rel, *slash; s != NULL;
+           s = slash != NULL ? slash + 1 : NULL) {
+        slash = strchr(s, '/');
+        be_write_str(f, s, slash != NULL ? slash - s : (int64_t)strlen(s));
+      }
+      fputc('e', f);
+      fputc('e', f);
+    }
+    fputc('e', f);
+  } else {
+    be_write_cstr(f, "length");
+    be_write_int(f, ct->total_length);
+  }
+  be_write_cstr(f, "name");
+  be_write_cstr(f, name);
+  be_write_cstr(f, "piece length");
+  be_write_int(f, ct->piece_length);
+  be_write_cstr(f, "pieces");
+  be_write_str(f, (char *)ct->hashes, (int64_t)ct->npieces * SHA_DIGEST_LENGTH);
+  fputc('e', f);
+  fputc('e', f);
 
-  // receive bitfield
-  n = recv(sockfd, data_buf, 4, 0);
-  if (n == 0) {
-    printf("Peer does not have any piece\n");
-    exit(0);
-  }
-  assert(n == 4);
-  n = ntohl(*(uint32_t *)data_buf);
-  assert(n <= 20000);
-  assert(recv(sockfd, data_buf + 4, n, 0) == n);
-  assert(data_buf[4] == 5);
-
-  uint8_t bitfield[n - 1];
-  memcpy(bitfield, data_buf + 5, n - 1);
-
-  // express interest
-  *(uint32_t *)data_buf = htonl(1);
-  data_buf[4] = 2;
-  assert(send(sockfd, data_buf, 5, 0) == 5);
-
-  // expect unchoked message
-  assert(recv(sockfd, data_buf, 4, 0) == 4);
-  n = ntohl(*(uint32_t *)data_buf);
-  assert(n <= 20000);
-  assert(recv(sockfd, data_buf + 4, n, 0) == n);
-  assert(data_buf[4] == 1);
-
-  bevalue_t v;
-  s = buf;
-  assert(next_value(&s, &v) == 0);
-  bevalue_t *info_v = bevec_dict_get(&v.val.vec, "info");
-  assert(info_v != NULL && info_v->type == BE_VEC && info_v->val.vec.is_dict);
-  bevalue_t *length_v = bevec_dict_get(&info_v->val.vec, "length");
-  assert(length_v != NULL && length_v->type == BE_INT);
-  bevalue_t *pieces_v = bevec_dict_get(&info_v->val.vec, "pieces");
-  assert(pieces_v != NULL && pieces_v->type == BE_STR);
-  bevalue_t *piece_length_v = bevec_dict_get(&info_v->val.vec, "piece length");
-  assert(piece_length_v != NULL && piece_length_v->type == BE_INT);
-
-  uint32_t total_length = length_v->val.i;
-  uint32_t piece_length = piece_length_v->val.i;
-  int32_t index = atoi(piece_index);
-  uint32_t piece_size = min(total_length - index * piece_length, piece_length);
-  uint8_t *piece = NULL;
-  assert(download_piece(sockfd, data_buf, index, piece_size, &piece) == 0);
-  assert(verify_piece(piece, piece_size,
-                      (uint8_t *)pieces_v->val.str.str +
-                          index * SHA_DIGEST_LENGTH) == 0);
-  assert(save_piece(piece, piece_size, outfile) == 0);
-
-  bevalue_free(&v);
-  bevalue_free(&res_v);
-  free(res.str);
-  free(piece);
-  free(buf);
+  if (ferror(f) | fclose(f)) {
+    fprintf(stderr, "Failed to write torrent file\n");
+    return 1;
+  }
   return 0;
 }
 
-int32_t download_everything(char *outfile, char *filename) {
-  char *buf = read_file(filename);
-  assert(buf != NULL);
+// Build a torrent for a file or a directory, hashing the data on every
+// core.
+int32_t create(options_t *opts, char *path) {
+  // the torrent is named after the last component of the path
+  char name_buf[strlen(path) + 1];
+  strcpy(name_buf, path);
+  for (size_t n = strlen(name_buf); n > 1 && name_buf[n - 1] == '/'; --n) {
+    name_buf[n - 1] = '\0';
+  }
+  char *name = strrchr(name_buf, '/');
+  name = name != NULL && name[1] != '\0' ? name + 1 : name_buf;
 
-  bestring_t res = {.str = malloc(0), .n = 0};
-  assert(perform_get_request(buf, &res) == 0);
-  bevalue_t res_v;
-  char *s = res.str;
-  assert(next_value(&s, &res_v) == 0);
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    perror(path);
+    return 1;
+  }
+  bool multi = S_ISDIR(st.st_mode);
+  // however far it gets, what it set up is torn down at out
+  int32_t nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  nthreads = nthreads < 1 ? 1 : nthreads;
+  pthread_t threads[nthreads];
+  create_t ct = {0};
+  int32_t ret = 1;
+  if (create_add(&ct, path, NULL) != 0) {
+    goto out;
+  }
+  if (ct.total_length == 0) {
+    fprintf(stderr, "Nothing to share in %s\n", path);
+    goto out;
+  }
 
-  bevalue_t *peers_v = bevec_dict_get(&res_v.val.vec, "peers");
-  assert(peers_v != NULL && peers_v->type == BE_STR);
+  ct.piece_length = opts->piece_length != 0
+                        ? opts->piece_length
+                        : create_piece_length(ct.total_length);
+  ct.npieces = (ct.total_length + ct.piece_length - 1) / ct.piece_length;
+  ct.batch = max(HASH_BATCH / ct.piece_length, 1);
+  ct.hashes = (uint8_t *)malloc((size_t)ct.npieces * SHA_DIGEST_LENGTH);
+  if (ct.hashes == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    goto out;
+  }
 
-  uint8_t *ptr = (uint8_t *)peers_v->val.str.str;
+  int64_t start = now_us();
+  int32_t started = 0;
+  for (; started < nthreads; ++started) {
+    if (pthread_create(&threads[started], NULL, create_worker, &ct) != 0) {
+      perror("Failed to start hashing thread");
+      break;
+    }
+  }
+  for (int32_t i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  if (started == 0) {
+    goto out;
+  }
+  nthreads = started;
+  int64_t elapsed = now_us() - start;
+  elapsed = elapsed < 1 ? 1 : elapsed;
 
-  int32_t sockfd;
-  struct sockaddr_in addr;
-  assert((sockfd = socket(AF_INET, SOCK_STREAM, 0)) > 0);
-  addr.sin_family = AF_INET;
-  addr.sin_port = *(uint16_t *)(ptr + 4);
-  addr.sin_addr.s_addr = *(uint32_t *)ptr;
-  assert(connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  ret = ct.failed ||
+        create_write(&ct, opts->outfile, opts->announce, name, multi);
+  torrent_t t;
+  if (ret == 0 && (ret = torrent_open(&t, opts->outfile)) == 0) {
+    printf("Files: %d\n", ct.nfiles);
+    printf("Length: %ld\n", ct.total_length);
+    printf("Piece Length: %d\n", ct.piece_length);
+    printf("Info Hash: ");
+    print_hex(t.info_hash);
+    printf("Throughput: %.1f MB/s (%d pieces, %d threads)\n",
+           ct.total_length / (double)elapsed, ct.npieces, nthreads);
+    torrent_close(&t);
+  }
 
-  uint8_t data_buf[20000] = {0};
-  uint32_t n = 0;
+out:
+  for (int32_t i = 0; i < ct.nfiles; ++i) {
+    if (ct.files[i].fd >= 0) {
+      close(ct.files[i].fd);
+    }
+    free(ct.files[i].path);
+    free(ct.files[i].rel);
+  }
+  free(ct.files);
+  free(ct.hashes);
+  return ret;
+}
 
-  assert(perform_handshake(sockfd, buf, data_buf) == 0);
+// Parse the options of the download, seed and create commands, which follow
+// the command name. On success argv[*pos] is the first positional argument.
+int32_t parse_options(int32_t argc, char **argv, options_t *opts,
+                      int32_t *pos) {
+  static struct option long_opts[] = {
+      {"mmap", no_argument, NULL, 'm'},
+      {"announce", required_argument, NULL, 'a'},
+      {"piece-length", required_argument, NULL, 'l'},
+      {"priority", required_argument, NULL, 'p'},
+      {"metrics", required_argument, NULL, 'M'},
+      {"port", required_argument, NULL, 'P'},
+      {"nagle", no_argument, NULL, 'N'},
+      {"zerocopy", no_argument, NULL, 'Z'},
+      {NULL, 0, NULL, 0},
+  };
+  opts->outfile = NULL;
+  opts->use_mmap = false;
+  opts->announce = NULL;
+  opts->piece_length = 0;
+  opts->priorities = NULL;
+  opts->metrics = NULL;
+  opts->port = DEFAULT_PORT;
+  opts->nagle = false;
+  opts->zerocopy = false;
 
-  // receive bitfield
-  n = recv(sockfd, data_buf, 4, 0);
-  if (n == 0) {
-    printf("Peer does not have any piece\n");
-    exit(0);
-  }
-  assert(n == 4);
-  n = ntohl(*(uint32_t *)data_buf);
-  assert(n <= 20000);
-  assert(recv(sockfd, data_buf + 4, n, 0) == n);
-  assert(data_buf[4] == 5);
-
-  uint8_t bitfield[n - 1];
-  memcpy(bitfield, data_buf + 5, n - 1);
-
-  // express interest
-  *(uint32_t *)data_buf = htonl(1);
-  data_buf[4] = 2;
-  assert(send(sockfd, data_buf, 5, 0) == 5);
-
-  // expect unchoked message
-  assert(recv(sockfd, data_buf, 4, 0) == 4);
-  n = ntohl(*(uint32_t *)data_buf);
-  assert(n <= 20000);
-  assert(recv(sockfd, data_buf + 4, n, 0) == n);
-  assert(data_buf[4] == 1);
-
-  bevalue_t v;
-  s = buf;
-  assert(next_value(&s, &v) == 0);
-  bevalue_t *info_v = bevec_dict_get(&v.val.vec, "info");
-  assert(info_v != NULL && info_v->type == BE_VEC && info_v->val.vec.is_dict);
-  bevalue_t *length_v = bevec_dict_get(&info_v->val.vec, "length");
-  assert(length_v != NULL && length_v->type == BE_INT);
-  bevalue_t *pieces_v = bevec_dict_get(&info_v->val.vec, "pieces");
-  assert(pieces_v != NULL && pieces_v->type == BE_STR);
-  bevalue_t *piece_length_v = bevec_dict_get(&info_v->val.vec, "piece length");
-  assert(piece_length_v != NULL && piece_length_v->type == BE_INT);
-
-  int32_t index = 0;
-  uint32_t total_length = length_v->val.i;
-  uint32_t piece_length = piece_length_v->val.i;
-  uint32_t remaining = total_length;
-  n = sizeof(bitfield) / sizeof(bitfield[0]);
-  for (int32_t i = 0; i < n; ++i) {
-    for (int32_t j = 7; j >= 0; --j, ++index) {
-      if (1 << j & bitfield[i]) {
-        uint8_t *piece = NULL;
-        uint32_t piece_size = min(remaining, piece_length);
-        assert(download_piece(sockfd, data_buf, index, piece_size, &piece) ==
-               0);
-        assert(verify_piece(piece, piece_size,
-                            (uint8_t *)pieces_v->val.str.str +
-                                index * SHA_DIGEST_LENGTH) == 0);
-        assert(save_piece(piece, piece_size, outfile) == 0);
-        free(piece);
-        remaining -= piece_size;
+  int32_t c;
+  optind = 1;
+  while ((c = getopt_long(argc - 1, argv + 1, "o:a:l:p:", long_opts, NULL)) !=
+         -1) {
+    switch (c) {
+    case 'o':
+      opts->outfile = optarg;
+      break;
+    case 'm':
+      opts->use_mmap = true;
+      break;
+    case 'a':
+      opts->announce = optarg;
+      break;
+    case 'l':
+      opts->piece_length = atoi(optarg);
+      if (opts->piece_length < BLOCK_SIZE ||
+          (opts->piece_length & (opts->piece_length - 1)) != 0) {
+        fprintf(stderr, "Piece length must be a power of two of at least "
+                        "16384\n");
+        return 1;
+      }
+      break;
+    case 'p':
+      opts->priorities = optarg;
+      break;
+    case 'M':
+      opts->metrics = optarg;
+      break;
+    case 'P':
+      opts->port = atoi(optarg);
+      if (opts->port == 0) {
+        fprintf(stderr, "Invalid port\n");
+        return 1;
       }
+      break;
+    case 'N':
+      opts->nagle = true;
+      break;
+    case 'Z':
+      opts->zerocopy = true;
+      break;
+    default:
+      return 1;
     }
   }
-
-  bevalue_free(&v);
-  bevalue_free(&res_v);
-  free(res.str);
-  free(buf);
+  *pos = optind + 1;
   return 0;
 }
 
@@ -948,14 +6319,62 @@ int32_t main(int32_t argc, char **argv) {
     if (handshake(argv[2], argv[3]) != 0) {
       return 1;
     }
+  } else if (strcmp(argv[1], "recheck") == 0) {
+    if (argc != 4) {
+      fprintf(stderr, "Usage: your_bittorrent.sh recheck <torrent> <file>\n");
+      return 1;
+    }
+    if (recheck(argv[2], argv[3]) != 0) {
+      return 1;
+    }
   } else if (strcmp(argv[1], "download_piece") == 0) {
-    assert(strcmp(argv[2], "-o") == 0);
-    if (download(argv[3], argv[4], argv[5]) != 0) {
+    options_t opts;
+    int32_t pos;
+    if (parse_options(argc, argv, &opts, &pos) != 0 || argc - pos != 2 ||
+        opts.outfile == NULL) {
+      fprintf(stderr, "Usage: your_bittorrent.sh download_piece -o <file> "
+                      "[--mmap] [--metrics <file>] <torrent> <piece>\n");
+      return 1;
+    }
+    if (download(&opts, argv[pos], argv[pos + 1]) != 0) {
       return 1;
     }
   } else if (strcmp(argv[1], "download") == 0) {
-    assert(strcmp(argv[2], "-o") == 0);
-    if (download_everything(argv[3], argv[4]) != 0) {
+    options_t opts;
+    int32_t pos;
+    if (parse_options(argc, argv, &opts, &pos) != 0 || argc - pos != 1 ||
+        opts.outfile == NULL) {
+      fprintf(stderr, "Usage: your_bittorrent.sh download -o <path> [--mmap] "
+                      "[--priority <file>=<level>,...] [--metrics <file>] "
+                      "[--port <port>] [--nagle] [--zerocopy] "
+                      "<torrent | magnet link>\n");
+      return 1;
+    }
+    if (download_everything(&opts, argv[pos]) != 0) {
+      return 1;
+    }
+  } else if (strcmp(argv[1], "seed") == 0) {
+    options_t opts;
+    int32_t pos;
+    if (parse_options(argc, argv, &opts, &pos) != 0 || argc - pos != 2) {
+      fprintf(stderr, "Usage: your_bittorrent.sh seed [--port <port>] "
+                      "[--metrics <file>] [--mmap] [--nagle] [--zerocopy] "
+                      "<torrent> <path>\n");
+      return 1;
+    }
+    if (seed(&opts, argv[pos], argv[pos + 1]) != 0) {
+      return 1;
+    }
+  } else if (strcmp(argv[1], "create") == 0) {
+    options_t opts;
+    int32_t pos;
+    if (parse_options(argc, argv, &opts, &pos) != 0 || argc - pos != 1 ||
+        opts.outfile == NULL || opts.announce == NULL) {
+      fprintf(stderr, "Usage: your_bittorrent.sh create -o <torrent> -a <url> "
+                      "[-l <piece length>] <path>\n");
+      return 1;
+    }
+    if (create(&opts, argv[pos]) != 0) {
       return 1;
     }
   } else {
@@ -0,0 +1,738 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <openssl/sha.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Loopback swarm benchmark. Starts a tracker stand-in and a number of
+// seeders on 127.0.0.1, runs the client's download command against them
+// and reports throughput, time to first piece, handshake latency and CPU
+// time per GB. Seeders delay every reply by the configured latency and
+// pace their uploads to the configured bandwidth.
+
+const uint32_t BLOCK_SIZE = 1 << 14;
+// most requests a seeder queues for one connection
+const uint32_t MAX_PENDING = 1024;
+
+typedef struct {
+  int64_t size;
+  int32_t piece_length;
+  int32_t seeders;
+  int32_t latency_ms;
+  int64_t rate;  // bytes per second per seeder, 0 for unlimited
+  int32_t piece; // download just this piece, -1 for everything
+  int32_t runs;
+  char *client;
+  char **client_args; // extra options passed to the download command
+  int32_t nclient_args;
+} bench_opts_t;
+
+// Written by the tracker and seeder processes, read by the harness after
+// each run. Times are CLOCK_MONOTONIC microseconds.
+typedef struct {
+  _Atomic int64_t first_piece_us;
+  _Atomic int64_t first_unchoke_us;
+  _Atomic int64_t handshake_us; // sum over connections
+  _Atomic int32_t handshakes;
+  _Atomic int64_t uploaded;
+  _Atomic uint32_t served[]; // bytes served per piece
+} stats_t;
+
+typedef struct {
+  uint32_t index;
+  uint32_t begin;
+  uint32_t length;
+  int64_t due_us;
+} pending_t;
+
+typedef struct {
+  bench_opts_t *opts;
+  uint8_t *data;
+  uint8_t *info_hash;
+  uint32_t npieces;
+  stats_t *stats;
+} swarm_t;
+
+int64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int32_t write_all(int32_t fd, void *buf, int64_t n) {
+  uint8_t *p = (uint8_t *)buf;
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return 1;
+    }
+    p += w;
+    n -= w;
+  }
+  return 0;
+}
+
+int32_t read_all(int32_t fd, void *buf, int64_t n) {
+  uint8_t *p = (uint8_t *)buf;
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return 1;
+    }
+    p += r;
+    n -= r;
+  }
+  return 0;
+}
+
+void sleep_us(int64_t us) {
+  if (us > 0) {
+    struct timespec ts = {.tv_sec = us / 1000000,
+                          .tv_nsec = us % 1000000 * 1000};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+  }
+}
+
+// Listen on an ephemeral loopback port and return it through port.
+int32_t listen_local(uint16_t *port) {
+  int32_t fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("Failed to create socket");
+    return -1;
+  }
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t len = sizeof(addr);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 64) != 0 ||
+      getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+    perror("Failed to listen");
+    close(fd);
+    return -1;
+  }
+  *port = ntohs(addr.sin_port);
+  return fd;
+}
+
+// Answer every announce with the compact list of seeders.
+void tracker(int32_t fd, uint16_t *ports, int32_t nports) {
+  char body[64 + 6 * nports];
+  int32_t n = sprintf(body, "d8:intervali60e5:peers%d:", 6 * nports);
+  for (int32_t i = 0; i < nports; ++i) {
+    uint8_t *p = (uint8_t *)body + n + 6 * i;
+    p[0] = 127, p[1] = 0, p[2] = 0, p[3] = 1;
+    p[4] = ports[i] >> 8, p[5] = ports[i] & 0xff;
+  }
+  n += 6 * nports;
+  body[n++] = 'e';
+
+  char req[4096];
+  for (;;) {
+    int32_t conn = accept(fd, NULL, NULL);
+    if (conn < 0) {
+      continue;
+    }
+    // the request is small, so reading up to the blank line is enough
+    int32_t len = 0;
+    while (len < (int32_t)sizeof(req) - 1) {
+      ssize_t r = read(conn, req + len, sizeof(req) - 1 - len);
+      if (r <= 0) {
+        break;
+      }
+      len += r;
+      req[len] = '\0';
+      if (strstr(req, "\r\n\r\n") != NULL) {
+        break;
+      }
+    }
+    char head[128];
+    int32_t m = sprintf(head,
+                        "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n"
+                        "Connection: close\r\n\r\n",
+                        n);
+    write_all(conn, head, m);
+    write_all(conn, body, n);
+    close(conn);
+  }
+}
+
+uint32_t piece_size(swarm_t *sw, uint32_t index) {
+  int64_t left = sw->opts->size - (int64_t)index * sw->opts->piece_length;
+  return left < sw->opts->piece_length ? left : sw->opts->piece_length;
+}
+
+// Send one block and account for it, marking the time the first piece
+// has been served in full.
+int32_t serve_block(swarm_t *sw, int32_t fd, pending_t *req) {
+  uint8_t head[13];
+  *(uint32_t *)head = htonl(9 + req->length);
+  head[4] = 7;
+  *(uint32_t *)(head + 5) = htonl(req->index);
+  *(uint32_t *)(head + 9) = htonl(req->begin);
+  uint8_t *block =
+      sw->data + (int64_t)req->index * sw->opts->piece_length + req->begin;
+  // one write per block, so Nagle never holds back the payload
+  struct iovec iov[2] = {{head, sizeof(head)}, {block, req->length}};
+  int64_t left = sizeof(head) + req->length;
+  while (left > 0) {
+    ssize_t w = writev(fd, iov, 2);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return 1;
+    }
+    left -= w;
+    for (int32_t i = 0; i < 2; ++i) {
+      size_t n = w < (ssize_t)iov[i].iov_len ? w : iov[i].iov_len;
+      iov[i].iov_base = (uint8_t *)iov[i].iov_base + n;
+      iov[i].iov_len -= n;
+      w -= n;
+    }
+  }
+  atomic_fetch_add(&sw->stats->uploaded, req->length);
+  uint32_t served =
+      atomic_fetch_add(&sw->stats->served[req->index], req->length) +
+      req->length;
+  int64_t zero = 0;
+  if (served >= piece_size(sw, req->index)) {
+    atomic_compare_exchange_strong(&sw->stats->first_piece_us, &zero,
+                                   now_us());
+  }
+  return 0;
+}
+
+// Serve one client connection: handshake, full bitfield, unchoke on
+// interest, then answer requests once they are latency old and the
+// bandwidth budget allows.
+void seeder_conn(swarm_t *sw, int32_t fd) {
+  int64_t accepted = now_us();
+  int64_t latency = (int64_t)sw->opts->latency_ms * 1000;
+  uint8_t hs[68];
+  if (read_all(fd, hs, sizeof(hs)) != 0 ||
+      memcmp(hs + 28, sw->info_hash, SHA_DIGEST_LENGTH) != 0) {
+    return;
+  }
+  sleep_us(latency);
+  memcpy(hs + 48, "-BENCH0-000000000000", 20);
+  uint32_t bflen = (sw->npieces + 7) / 8;
+  uint8_t *bitfield = (uint8_t *)calloc(5 + bflen, 1);
+  *(uint32_t *)bitfield = htonl(1 + bflen);
+  bitfield[4] = 5;
+  for (uint32_t i = 0; i < sw->npieces; ++i) {
+    bitfield[5 + i / 8] |= 0x80 >> (i % 8);
+  }
+  int32_t ret = write_all(fd, hs, sizeof(hs)) ||
+                write_all(fd, bitfield, 5 + bflen);
+  free(bitfield);
+  if (ret != 0) {
+    return;
+  }
+
+  pending_t *queue = (pending_t *)malloc(MAX_PENDING * sizeof(pending_t));
+  uint32_t head = 0, npending = 0;
+  uint8_t buf[1 << 16];
+  uint32_t len = 0;
+  bool greeted = false;
+  int64_t next_send = 0;
+  for (;;) {
+    int64_t now = now_us();
+    // send what is due, as far as the bandwidth allows
+    while (npending > 0 && queue[head].due_us <= now && next_send <= now) {
+      pending_t *req = &queue[head];
+      if (serve_block(sw, fd, req) != 0) {
+        goto done;
+      }
+      if (sw->opts->rate > 0) {
+        next_send = (next_send > now ? next_send : now) +
+                    (int64_t)req->length * 1000000 / sw->opts->rate;
+      }
+      head = (head + 1) % MAX_PENDING;
+      --npending;
+      now = now_us();
+    }
+
+    int32_t timeout = -1;
+    if (npending > 0) {
+      int64_t at = queue[head].due_us > next_send ? queue[head].due_us
+                                                  : next_send;
+      timeout = (at - now + 999) / 1000;
+    }
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+      goto done;
+    }
+    if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+      continue;
+    }
+    ssize_t r = read(fd, buf + len, sizeof(buf) - len);
+    if (r <= 0) {
+      goto done;
+    }
+    len += r;
+
+    uint32_t off = 0;
+    while (len - off >= 4) {
+      uint32_t msg_len = ntohl(*(uint32_t *)(buf + off));
+      if (msg_len > sizeof(buf) - 4) {
+        goto done;
+      }
+      if (len - off < 4 + msg_len) {
+        break;
+      }
+      uint8_t *msg = buf + off + 4;
+      off += 4 + msg_len;
+      if (msg_len == 0) {
+        continue;
+      }
+      if (!greeted) {
+        // the first message after our handshake closes the round trip
+        greeted = true;
+        atomic_fetch_add(&sw->stats->handshake_us, now_us() - accepted);
+        atomic_fetch_add(&sw->stats->handshakes, 1);
+      }
+      if (msg[0] == 2) { // interested
+        uint8_t unchoke[5] = {0, 0, 0, 1, 1};
+        if (write_all(fd, unchoke, sizeof(unchoke)) != 0) {
+          goto done;
+        }
+        int64_t zero = 0;
+        atomic_compare_exchange_strong(&sw->stats->first_unchoke_us, &zero,
+                                       now_us());
+      } else if (msg[0] == 6 && msg_len == 13) { // request
+        pending_t req = {
+            .index = ntohl(*(uint32_t *)(msg + 1)),
+            .begin = ntohl(*(uint32_t *)(msg + 5)),
+            .length = ntohl(*(uint32_t *)(msg + 9)),
+            .due_us = now_us() + latency,
+        };
+        if (req.index >= sw->npieces || req.length > BLOCK_SIZE ||
+            (int64_t)req.begin + req.length > piece_size(sw, req.index) ||
+            npending == MAX_PENDING) {
+          goto done;
+        }
+        queue[(head + npending) % MAX_PENDING] = req;
+        ++npending;
+      }
+    }
+    memmove(buf, buf + off, len - off);
+    len -= off;
+  }
+
+done:
+  free(queue);
+}
+
+// Accept connections and serve each in its own process.
+void seeder(swarm_t *sw, int32_t fd) {
+  for (;;) {
+    int32_t conn = accept(fd, NULL, NULL);
+    if (conn < 0) {
+      continue;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      close(fd);
+      seeder_conn(sw, conn);
+      _exit(0);
+    }
+    close(conn);
+    // reap finished connections
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+    }
+  }
+}
+
+void be_write_int(FILE *f, int64_t i) { fprintf(f, "i%lde", i); }
+
+void be_write_str(FILE *f, void *str, int64_t n) {
+  fprintf(f, "%ld:", n);
+  fwrite(str, 1, n, f);
+}
+
+void be_write_cstr(FILE *f, char *str) { be_write_str(f, str, strlen(str)); }
+
+// Fill the data file and write a single-file torrent for it.
+int32_t make_torrent(swarm_t *sw, char *dir, uint16_t tracker_port) {
+  bench_opts_t *opts = sw->opts;
+  sw->data = (uint8_t *)malloc(opts->size);
+  if (sw->data == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  uint64_t x = 0x9e3779b97f4a7c15;
+  for (int64_t i = 0; i < opts->size; ++i) {
+    // xorshift, cheap and not compressible
+    x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+    sw->data[i] = x;
+  }
+
+  sw->npieces = (opts->size + opts->piece_length - 1) / opts->piece_length;
+  uint8_t *hashes = (uint8_t *)malloc(sw->npieces * SHA_DIGEST_LENGTH);
+  for (uint32_t i = 0; i < sw->npieces; ++i) {
+    SHA1(sw->data + (int64_t)i * opts->piece_length, piece_size(sw, i),
+         hashes + i * SHA_DIGEST_LENGTH);
+  }
+
+  char *info;
+  size_t info_len;
+  FILE *f = open_memstream(&info, &info_len);
+  fprintf(f, "d");
+  be_write_cstr(f, "length");
+  be_write_int(f, opts->size);
+  be_write_cstr(f, "name");
+  be_write_cstr(f, "bench.bin");
+  be_write_cstr(f, "piece length");
+  be_write_int(f, opts->piece_length);
+  be_write_cstr(f, "pieces");
+  be_write_str(f, hashes, sw->npieces * SHA_DIGEST_LENGTH);
+  fprintf(f, "e");
+  fclose(f);
+  free(hashes);
+  sw->info_hash = (uint8_t *)malloc(SHA_DIGEST_LENGTH);
+  SHA1((uint8_t *)info, info_len, sw->info_hash);
+
+  char path[strlen(dir) + sizeof("/bench.torrent")];
+  sprintf(path, "%s/bench.torrent", dir);
+  f = fopen(path, "wb");
+  if (f == NULL) {
+    perror("Failed to create torrent");
+    free(info);
+    return 1;
+  }
+  char announce[64];
+  sprintf(announce, "http://127.0.0.1:%d/announce", tracker_port);
+  fprintf(f, "d");
+  be_write_cstr(f, "announce");
+  be_write_cstr(f, announce);
+  be_write_cstr(f, "info");
+  fwrite(info, 1, info_len, f);
+  fprintf(f, "e");
+  fclose(f);
+  free(info);
+  return 0;
+}
+
+typedef struct {
+  double seconds;
+  double first_piece_ms;
+  double first_unchoke_ms;
+  double handshake_ms;
+  double cpu_per_gb;
+} result_t;
+
+// Run the client once against the swarm and check its output.
+int32_t run_client(swarm_t *sw, char *dir, result_t *res) {
+  bench_opts_t *opts = sw->opts;
+  char out[strlen(dir) + sizeof("/out.bin.resume")];
+  sprintf(out, "%s/out.bin.resume", dir);
+  unlink(out);
+  sprintf(out, "%s/out.bin", dir);
+  unlink(out);
+  char torrent[strlen(dir) + sizeof("/bench.torrent")];
+  sprintf(torrent, "%s/bench.torrent", dir);
+  char piece[16];
+  sprintf(piece, "%d", opts->piece);
+
+  char *argv[opts->nclient_args + 8];
+  int32_t argc = 0;
+  argv[argc++] = opts->client;
+  argv[argc++] = opts->piece < 0 ? "download" : "download_piece";
+  argv[argc++] = "-o";
+  argv[argc++] = out;
+  for (int32_t i = 0; i < opts->nclient_args; ++i) {
+    argv[argc++] = opts->client_args[i];
+  }
+  argv[argc++] = torrent;
+  if (opts->piece >= 0) {
+    argv[argc++] = piece;
+  }
+  argv[argc] = NULL;
+
+  memset(sw->stats, 0, sizeof(stats_t) + sw->npieces * sizeof(uint32_t));
+  int64_t start = now_us();
+  pid_t pid = fork();
+  if (pid == 0) {
+    // keep the benchmark output to the client's own errors
+    int32_t null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    execv(opts->client, argv);
+    perror("Failed to run client");
+    _exit(127);
+  }
+  int32_t status;
+  struct rusage ru;
+  if (pid < 0 || wait4(pid, &status, 0, &ru) != pid) {
+    perror("Failed to wait for client");
+    return 1;
+  }
+  int64_t elapsed = now_us() - start;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Client failed\n");
+    return 1;
+  }
+
+  // the output must match what the seeders hold
+  int64_t offset = opts->piece < 0 ? 0 : (int64_t)opts->piece *
+                                             opts->piece_length;
+  int64_t size = opts->piece < 0 ? opts->size : piece_size(sw, opts->piece);
+  int32_t fd = open(out, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size != size) {
+    fprintf(stderr, "Output has the wrong size\n");
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+  uint8_t *got = (uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (got == MAP_FAILED || memcmp(got, sw->data + offset, size) != 0) {
+    fprintf(stderr, "Output does not match the data\n");
+    if (got != MAP_FAILED) {
+      munmap(got, size);
+    }
+    return 1;
+  }
+  munmap(got, size);
+
+  double cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+               (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+  int64_t first = atomic_load(&sw->stats->first_piece_us);
+  int64_t unchoke = atomic_load(&sw->stats->first_unchoke_us);
+  int32_t handshakes = atomic_load(&sw->stats->handshakes);
+  res->seconds = elapsed / 1e6;
+  res->first_piece_ms = first == 0 ? 0 : (first - start) / 1e3;
+  res->first_unchoke_ms = unchoke == 0 ? 0 : (unchoke - start) / 1e3;
+  res->handshake_ms =
+      handshakes == 0
+          ? 0
+          : atomic_load(&sw->stats->handshake_us) / 1e3 / handshakes;
+  res->cpu_per_gb = cpu / (size / 1e9);
+  printf("Run: %.1f MB/s, first unchoke %.1f ms, first piece %.1f ms, "
+         "handshake %.1f ms, %.2f CPU s/GB, %.1f%% uploaded twice\n",
+         size / (double)elapsed, res->first_unchoke_ms, res->first_piece_ms,
+         res->handshake_ms, res->cpu_per_gb,
+         100.0 * (atomic_load(&sw->stats->uploaded) - size) / size);
+  return 0;
+}
+
+int32_t cmp_results(const void *a, const void *b) {
+  double x = ((result_t *)a)->seconds, y = ((result_t *)b)->seconds;
+  return (x > y) - (x < y);
+}
+
+int32_t bench(bench_opts_t *opts) {
+  swarm_t sw = {.opts = opts};
+  char dir[] = "/tmp/bench.XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("Failed to create directory");
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  uint16_t tracker_port;
+  int32_t tracker_fd = listen_local(&tracker_port);
+  assert(tracker_fd >= 0);
+  if (make_torrent(&sw, dir, tracker_port) != 0) {
+    return 1;
+  }
+  if (opts->piece >= (int32_t)sw.npieces) {
+    fprintf(stderr, "Piece %d is out of range\n", opts->piece);
+    return 1;
+  }
+  size_t stats_size = sizeof(stats_t) + sw.npieces * sizeof(uint32_t);
+  sw.stats = (stats_t *)mmap(NULL, stats_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  assert(sw.stats != MAP_FAILED);
+
+  // every helper dies with the harness
+  pid_t pids[opts->seeders + 1];
+  uint16_t ports[opts->seeders];
+  for (int32_t i = 0; i < opts->seeders; ++i) {
+    int32_t fd = listen_local(&ports[i]);
+    assert(fd >= 0);
+    pids[i] = fork();
+    if (pids[i] == 0) {
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      close(tracker_fd);
+      seeder(&sw, fd);
+      _exit(0);
+    }
+    close(fd);
+  }
+  pids[opts->seeders] = fork();
+  if (pids[opts->seeders] == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    tracker(tracker_fd, ports, opts->seeders);
+    _exit(0);
+  }
+  close(tracker_fd);
+
+  printf("Swarm: %d seeders, %ld bytes, %d byte pieces, %d ms latency, ",
+         opts->seeders, opts->size, opts->piece_length, opts->latency_ms);
+  if (opts->rate > 0) {
+    printf("%.1f MB/s per seeder\n", opts->rate / 1e6);
+  } else {
+    printf("unlimited bandwidth\n");
+  }
+  fflush(stdout);
+
+  result_t results[opts->runs];
+  int32_t ret = 0;
+  for (int32_t i = 0; i < opts->runs && ret == 0; ++i) {
+    ret = run_client(&sw, dir, &results[i]);
+    fflush(stdout);
+  }
+  if (ret == 0) {
+    // the median run is less sensitive to a noisy neighbour
+    qsort(results, opts->runs, sizeof(result_t), cmp_results);
+    result_t *med = &results[opts->runs / 2];
+    int64_t size = opts->piece < 0 ? opts->size : piece_size(&sw, opts->piece);
+    printf("Throughput: %.1f MB/s\n", size / med->seconds / 1e6);
+    printf("Time to first unchoke: %.1f ms\n", med->first_unchoke_ms);
+    printf("Time to first piece: %.1f ms\n", med->first_piece_ms);
+    printf("Handshake latency: %.1f ms\n", med->handshake_ms);
+    printf("CPU: %.2f s/GB\n", med->cpu_per_gb);
+  }
+
+  for (int32_t i = 0; i <= opts->seeders; ++i) {
+    kill(pids[i], SIGKILL);
+    waitpid(pids[i], NULL, 0);
+  }
+  char path[sizeof(dir) + sizeof("/out.bin.resume")];
+  const char *files[] = {"bench.torrent", "out.bin", "out.bin.resume"};
+  for (uint32_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+    sprintf(path, "%s/%s", dir, files[i]);
+    unlink(path);
+  }
+  rmdir(dir);
+  munmap(sw.stats, stats_size);
+  free(sw.info_hash);
+  free(sw.data);
+  return ret;
+}
+
+int64_t parse_size(char *s) {
+  char *end;
+  int64_t n = strtoll(s, &end, 10);
+  switch (*end) {
+  case 'k':
+  case 'K':
+    return n << 10;
+  case 'm':
+  case 'M':
+    return n << 20;
+  case 'g':
+  case 'G':
+    return n << 30;
+  case '\0':
+    return n;
+  default:
+    return -1;
+  }
+}
+
+void usage(void) {
+  fprintf(stderr,
+          "Usage: bench [--size <bytes>] [--piece-length <bytes>] "
+          "[--seeders <n>]\n"
+          "             [--latency <ms>] [--rate <bytes/s>] [--piece <index>]"
+          "\n"
+          "             [--runs <n>] <client> [-- <download options>]\n");
+}
+
+int32_t main(int32_t argc, char **argv) {
+  static struct option long_opts[] = {
+      {"size", required_argument, NULL, 's'},
+      {"piece-length", required_argument, NULL, 'l'},
+      {"seeders", required_argument, NULL, 'n'},
+      {"latency", required_argument, NULL, 'd'},
+      {"rate", required_argument, NULL, 'r'},
+      {"piece", required_argument, NULL, 'p'},
+      {"runs", required_argument, NULL, 'k'},
+      {NULL, 0, NULL, 0},
+  };
+  bench_opts_t opts = {
+      .size = 64 << 20,
+      .piece_length = 256 << 10,
+      .seeders = 4,
+      .latency_ms = 0,
+      .rate = 0,
+      .piece = -1,
+      .runs = 3,
+  };
+
+  int32_t c;
+  while ((c = getopt_long(argc, argv, "+", long_opts, NULL)) != -1) {
+    switch (c) {
+    case 's':
+      opts.size = parse_size(optarg);
+      break;
+    case 'l':
+      opts.piece_length = parse_size(optarg);
+      break;
+    case 'n':
+      opts.seeders = atoi(optarg);
+      break;
+    case 'd':
+      opts.latency_ms = atoi(optarg);
+      break;
+    case 'r':
+      opts.rate = parse_size(optarg);
+      break;
+    case 'p':
+      opts.piece = atoi(optarg);
+      break;
+    case 'k':
+      opts.runs = atoi(optarg);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (optind >= argc || opts.size <= 0 || opts.piece_length < BLOCK_SIZE ||
+      opts.seeders <= 0 || opts.latency_ms < 0 || opts.rate < 0 ||
+      opts.runs <= 0) {
+    usage();
+    return 1;
+  }
+  opts.client = argv[optind];
+  // everything after the client, including a "--", is passed through
+  opts.client_args = argv + optind + 1;
+  opts.nclient_args = argc - optind - 1;
+  if (opts.nclient_args > 0 && strcmp(opts.client_args[0], "--") == 0) {
+    ++opts.client_args;
+    --opts.nclient_args;
+  }
+  return bench(&opts);
+}